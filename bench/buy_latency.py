@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+# Measures buy latency in server mode while other clients run full
+# catalog scans that read their replies slowly.
+#
+# usage: bench/buy_latency.py BINARY [BOOKS] [BUYS]
+#
+# Builds a catalog of BOOKS books in a scratch directory, starts
+# BINARY --serve there, and for 0, 1 and 4 scanning clients times BUYS
+# buys from one more client. Buy latency should stay flat as scanners
+# are added.
+import multiprocessing
+import os
+import shutil
+import socket
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+SCANNER_COUNTS = (0, 1, 4)
+
+
+def catalog(books):
+    lines = ["su root sjtu"]
+    for i in range(books):
+        lines.append("select ISBN%06d" % i)
+        lines.append('modify -name="Book %d" -author="Author %d" -keyword="k%d|common" -price=%d.50'
+                     % (i, i % 500, i % 50, i % 90 + 1))
+        lines.append("import 1000000 1")
+    return ("\n".join(lines) + "\n").encode()
+
+
+def connect(path):
+    client = socket.socket(socket.AF_UNIX)
+    client.connect(path)
+    return client
+
+
+def scanner(path, stop, scans):
+    # Reads 16 KiB at a time with a pause between reads, like a slow client
+    client = connect(path)
+    client.sendall(b"su root sjtu\n")
+    while not stop.is_set():
+        # The second query matches nothing, so its reply is the empty line
+        # that ends the listing
+        client.sendall(b"show\nshow -ISBN=END\n")
+        tail = b""
+        while not tail.endswith(b"\n\n"):
+            chunk = client.recv(16384)
+            if not chunk:
+                return
+            tail = (tail + chunk)[-2:]
+            time.sleep(0.005)
+        with scans.get_lock():
+            scans.value += 1
+    client.close()
+
+
+def measure(path, books, buys, scanners):
+    stop = multiprocessing.Event()
+    scans = multiprocessing.Value("i", 0)
+    workers = [multiprocessing.Process(target=scanner, args=(path, stop, scans))
+               for _ in range(scanners)]
+    for worker in workers:
+        worker.start()
+    time.sleep(0.5)
+
+    client = connect(path)
+    stream = client.makefile("rwb")
+    stream.write(b"su root sjtu\n")
+    stream.flush()
+    latencies = []
+    for i in range(buys):
+        command = b"buy ISBN%06d 1\n" % (i * 7919 % books)
+        start = time.perf_counter()
+        stream.write(command)
+        stream.flush()
+        stream.readline()
+        latencies.append((time.perf_counter() - start) * 1e6)
+    stop.set()
+    for worker in workers:
+        worker.join()
+    client.close()
+
+    latencies.sort()
+    print("scanners=%d scans=%d buy us: mean=%.0f p50=%.0f p90=%.0f p99=%.0f max=%.0f" % (
+        scanners, scans.value, statistics.mean(latencies), latencies[len(latencies) // 2],
+        latencies[len(latencies) * 9 // 10], latencies[len(latencies) * 99 // 100], latencies[-1]))
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("usage: %s BINARY [BOOKS] [BUYS]" % sys.argv[0])
+    binary = os.path.abspath(sys.argv[1])
+    books = int(sys.argv[2]) if len(sys.argv) > 2 else 20000
+    buys = int(sys.argv[3]) if len(sys.argv) > 3 else 1000
+
+    directory = tempfile.mkdtemp(prefix="bookstore-bench-")
+    path = os.path.join(directory, "server.sock")
+    server = None
+    try:
+        subprocess.run([binary], input=catalog(books), cwd=directory,
+                       stdout=subprocess.DEVNULL, check=True)
+        server = subprocess.Popen([binary, "--serve", path], cwd=directory)
+        while not os.path.exists(path):
+            time.sleep(0.05)
+        for scanners in SCANNER_COUNTS:
+            measure(path, books, buys, scanners)
+    finally:
+        if server:
+            server.terminate()
+            server.wait()
+        shutil.rmtree(directory)
+
+
+if __name__ == "__main__":
+    main()
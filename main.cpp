@@ -1,23 +1,53 @@
-#include <iostream>
-#include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <deque>
+#include <unordered_map>
 #include <set>
 #include <algorithm>
 #include <cstring>
-#include <iomanip>
 #include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <csignal>
+#include <cmath>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 // Constants
 const int MAX_STRING_LEN = 65;
-const string ACCOUNT_FILE = "accounts.dat";
-const string BOOK_FILE = "books.dat";
-const string FINANCE_FILE = "finance.dat";
+const string DATABASE_FILE = "bookstore.dat";
+const string REDO_LOG_FILE = "redo.dat";
 const string LOG_FILE = "log.dat";
 
+// Buffer pool size in 4 KiB pages; BOOKSTORE_POOL_PAGES overrides it
+const int BUFFER_POOL_PAGES = 1024;
+
+// Dirty pages are written back after this many commands or milliseconds,
+// whichever comes first, and on shutdown
+const int FLUSH_INTERVAL_COMMANDS = 4096;
+const int FLUSH_INTERVAL_MS = 1000;
+
+// Pages per Bloom filter (32768 bits each); sizes an existing filter
+// keeps are fixed when it is created. Setting BOOKSTORE_STATS prints the
+// filters' false-positive rates on shutdown.
+const int BLOOM_FILTER_PAGES = 32;
+
 // Utility functions
 bool isValidChar(char c, bool allowQuote = true) {
     if (c < 32 || c > 126) return false;
@@ -25,7 +55,7 @@ bool isValidChar(char c, bool allowQuote = true) {
     return true;
 }
 
-bool isValidUserID(const string& s) {
+bool isValidUserID(string_view s) {
     if (s.empty() || s.length() > 30) return false;
     for (char c : s) {
         if (!isalnum(c) && c != '_') return false;
@@ -33,11 +63,11 @@ bool isValidUserID(const string& s) {
     return true;
 }
 
-bool isValidPassword(const string& s) {
+bool isValidPassword(string_view s) {
     return isValidUserID(s);
 }
 
-bool isValidUsername(const string& s) {
+bool isValidUsername(string_view s) {
     if (s.empty() || s.length() > 30) return false;
     for (char c : s) {
         if (!isValidChar(c)) return false;
@@ -45,7 +75,7 @@ bool isValidUsername(const string& s) {
     return true;
 }
 
-bool isValidISBN(const string& s) {
+bool isValidISBN(string_view s) {
     if (s.empty() || s.length() > 20) return false;
     for (char c : s) {
         if (!isValidChar(c)) return false;
@@ -53,7 +83,7 @@ bool isValidISBN(const string& s) {
     return true;
 }
 
-bool isValidBookName(const string& s) {
+bool isValidBookName(string_view s) {
     if (s.empty() || s.length() > 60) return false;
     for (char c : s) {
         if (!isValidChar(c, false)) return false;
@@ -61,29 +91,30 @@ bool isValidBookName(const string& s) {
     return true;
 }
 
-bool isValidKeyword(const string& s) {
+bool isValidKeyword(string_view s) {
     if (s.empty() || s.length() > 60) return false;
-    vector<string> parts;
-    string part;
-    for (char c : s) {
-        if (c == '|') {
-            if (part.empty()) return false;
-            parts.push_back(part);
-            part.clear();
-        } else {
-            if (!isValidChar(c, false)) return false;
-            part += c;
+    // At most 30 segments fit in 60 characters
+    string_view parts[30];
+    int count = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= s.length(); i++) {
+        if (i < s.length() && s[i] != '|') {
+            if (!isValidChar(s[i], false)) return false;
+            continue;
+        }
+        if (i == start) return false;
+        string_view part = s.substr(start, i - start);
+        // Check for duplicates
+        for (int j = 0; j < count; j++) {
+            if (parts[j] == part) return false;
         }
+        parts[count++] = part;
+        start = i + 1;
     }
-    if (part.empty()) return false;
-    parts.push_back(part);
-    
-    // Check for duplicates
-    set<string> unique(parts.begin(), parts.end());
-    return unique.size() == parts.size();
+    return true;
 }
 
-bool isValidQuantity(const string& s) {
+bool isValidQuantity(string_view s) {
     if (s.empty() || s.length() > 10) return false;
     for (char c : s) {
         if (!isdigit(c)) return false;
@@ -91,10 +122,55 @@ bool isValidQuantity(const string& s) {
     return true;
 }
 
-bool isValidPrice(const string& s) {
+// Converts a string accepted by isValidQuantity
+long long parseQuantity(string_view s) {
+    long long value = 0;
+    for (char c : s) value = value * 10 + (c - '0');
+    return value;
+}
+
+bool startsWith(string_view s, string_view prefix) {
+    return s.substr(0, prefix.length()) == prefix;
+}
+
+// Extracts the text of a -flag="value" argument whose prefix is already
+// known to match; fails unless the value is quoted and non-empty
+bool quotedValue(string_view arg, size_t prefixLength, string_view& value) {
+    if (arg.length() < prefixLength + 3 || arg[prefixLength] != '"' || arg.back() != '"') {
+        return false;
+    }
+    value = arg.substr(prefixLength + 1, arg.length() - prefixLength - 2);
+    return true;
+}
+
+// Copies s into a zero-terminated char field
+template <size_t N>
+void copyField(char (&field)[N], string_view s) {
+    size_t length = min(s.length(), N - 1);
+    // An empty view may have a null data(), which memcpy must not see
+    if (length > 0) memcpy(field, s.data(), length);
+    field[length] = 0;
+}
+
+// 32-bit FNV-1a, used to detect torn writes
+unsigned int fnv1a(const char* data, size_t length) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Amount of money in cents. A price of up to 13 digits times an int
+// quantity needs about 81 bits, so amounts and their sums are 128-bit.
+typedef __int128 Money;
+
+// Validates a price with at most two decimals and converts it to cents
+bool parsePrice(string_view s, Money& cents) {
     if (s.empty() || s.length() > 13) return false;
     bool hasDot = false;
     int beforeDot = 0, afterDot = 0;
+    Money value = 0;
     for (char c : s) {
         if (c == '.') {
             if (hasDot) return false;
@@ -102,34 +178,77 @@ bool isValidPrice(const string& s) {
         } else if (isdigit(c)) {
             if (hasDot) afterDot++;
             else beforeDot++;
+            value = value * 10 + (c - '0');
         } else {
             return false;
         }
     }
     if (beforeDot == 0) return false;  // Must have at least one digit before dot
-    return !hasDot || afterDot <= 2;
+    if (afterDot > 2) return false;
+    for (int i = afterDot; i < 2; i++) value *= 10;
+    cents = value;
+    return true;
+}
+
+// Writes cents with exactly two decimals and returns the end of the text
+char* formatMoney(Money cents, char* out) {
+    if (cents < 0) {
+        *out++ = '-';
+        cents = -cents;
+    }
+    char digits[40];
+    int length = 0;
+    Money whole = cents / 100;
+    do {
+        digits[length++] = '0' + whole % 10;
+        whole /= 10;
+    } while (whole > 0);
+    while (length > 0) *out++ = digits[--length];
+    *out++ = '.';
+    *out++ = '0' + cents % 100 / 10;
+    *out++ = '0' + cents % 10;
+    return out;
+}
+
+// Opens a binary file for in-place reads and writes, creating it if needed
+int openDataFile(const string& fileName) {
+    int fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) throw runtime_error("cannot open " + fileName);
+    return fd;
+}
+
+// Writes all of data at offset, giving up only on an I/O error
+void writeFully(int fd, const char* data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written <= 0) return;
+        data += written;
+        length -= written;
+        offset += written;
+    }
 }
 
 // Data structures
 struct Account {
     char userID[31];
     char password[31];
-    char username[31];
+    int username;  // StringHeap id
     int privilege;
     
-    Account() : privilege(0) {
+    Account() : username(0), privilege(0) {
         memset(userID, 0, sizeof(userID));
         memset(password, 0, sizeof(password));
-        memset(username, 0, sizeof(username));
     }
 };
 
+// A book as presented to commands. On disk it is split into a hot
+// BookStock and a cold BookInfo, see BookManager.
 struct Book {
     char ISBN[21];
     char name[61];
     char author[61];
     char keyword[61];
-    double price;
+    Money price;
     int quantity;
     
     Book() : price(0), quantity(0) {
@@ -141,666 +260,3302 @@ struct Book {
 };
 
 struct Transaction {
-    double amount;
+    int sequence;
+    char userID[31];
+    char ISBN[21];
+    int quantity;
+    Money amount;
     bool isIncome;
+
+    Transaction() : sequence(0), quantity(0), amount(0), isIncome(false) {
+        memset(userID, 0, sizeof(userID));
+        memset(ISBN, 0, sizeof(ISBN));
+    }
+};
+
+// Paged file storage
+const int PAGE_SIZE = 4096;
+
+struct Page {
+    alignas(16) char data[PAGE_SIZE];
+
+    Page() {
+        memset(data, 0, sizeof(data));
+    }
+};
+
+class BufferPool;
+
+// A page pinned in the buffer pool; it is unpinned when the handle dies
+class PageHandle {
+private:
+    BufferPool* pool;
+    int frame;
+    char* bytes;
+
+public:
+    PageHandle() : pool(nullptr), frame(-1), bytes(nullptr) {}
+
+    PageHandle(BufferPool* owner, int frameID, char* data)
+        : pool(owner), frame(frameID), bytes(data) {}
+
+    PageHandle(PageHandle&& other) : pool(other.pool), frame(other.frame), bytes(other.bytes) {
+        other.pool = nullptr;
+    }
+
+    PageHandle& operator=(PageHandle&& other);
+
+    PageHandle(const PageHandle&) = delete;
+    PageHandle& operator=(const PageHandle&) = delete;
+
+    ~PageHandle();
+
+    char* data() {
+        return bytes;
+    }
+
+    void markDirty();
+};
+
+// A file of fixed-size pages. All page access goes through the buffer pool;
+// only the pool itself touches the underlying file. Batches of dirty pages
+// reach the file through a redo log, which is on disk before the first page
+// is overwritten, so a crash halfway through writing a batch in place is
+// repaired when the file is next opened.
+class PagedFile {
+private:
+    friend class BufferPool;
+
+    static const int REDO_MAGIC = 0x5245444f;
+
+    struct RedoHeader {
+        int magic;
+        int pageCount;
+        unsigned int checksum;
+    };
+
+    BufferPool& pool;
+    int fd;
+    int redoFd;
+    int fileID;
+    int pageCount;
+    vector<char> redoBuffer;
+
+    void readPage(int pageID, char* data) {
+        ssize_t bytes = pread(fd, data, PAGE_SIZE, (off_t)pageID * PAGE_SIZE);
+        if (bytes < 0) bytes = 0;
+        // Allocated pages may not have reached the disk yet
+        if (bytes < PAGE_SIZE) memset(data + bytes, 0, PAGE_SIZE - bytes);
+    }
+
+    void writePage(int pageID, const char* data) {
+        writeFully(fd, data, PAGE_SIZE, (off_t)pageID * PAGE_SIZE);
+    }
+
+    void sync() {
+        fdatasync(fd);
+    }
+
+    // Cuts the log back to an empty header, so its size follows the last
+    // batch only. A cleared log that does not reach the disk is only
+    // replayed again.
+    void clearRedoLog() {
+        RedoHeader header = {0, 0, 0};
+        writeFully(redoFd, (const char*)&header, sizeof(header), 0);
+        // Should this fail, the tail stays behind a header marking it empty
+        if (ftruncate(redoFd, sizeof(header)) != 0) return;
+    }
+
+    // Replays a complete batch left behind by a crash; a torn batch never
+    // reached the file and is dropped
+    void recover() {
+        RedoHeader header;
+        if (pread(redoFd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            header.magic != REDO_MAGIC || header.pageCount <= 0) {
+            return;
+        }
+
+        size_t recordSize = sizeof(int) + PAGE_SIZE;
+        redoBuffer.resize(header.pageCount * recordSize);
+        ssize_t bytes = pread(redoFd, redoBuffer.data(), redoBuffer.size(), sizeof(header));
+        if (bytes == (ssize_t)redoBuffer.size() &&
+            fnv1a(redoBuffer.data(), redoBuffer.size()) == header.checksum) {
+            for (int i = 0; i < header.pageCount; i++) {
+                const char* record = redoBuffer.data() + i * recordSize;
+                int pageID;
+                memcpy(&pageID, record, sizeof(int));
+                writePage(pageID, record + sizeof(int));
+                pageCount = max(pageCount, pageID + 1);
+            }
+            sync();
+        }
+        clearRedoLog();
+    }
+
+    // Logs the batch, writes it in place, then retires the log
+    void writeBatch(const vector<pair<int, const char*>>& pages) {
+        size_t recordSize = sizeof(int) + PAGE_SIZE;
+        redoBuffer.resize(sizeof(RedoHeader) + pages.size() * recordSize);
+        char* payload = redoBuffer.data() + sizeof(RedoHeader);
+        for (size_t i = 0; i < pages.size(); i++) {
+            memcpy(payload + i * recordSize, &pages[i].first, sizeof(int));
+            memcpy(payload + i * recordSize + sizeof(int), pages[i].second, PAGE_SIZE);
+        }
+        RedoHeader header = {REDO_MAGIC, (int)pages.size(),
+                             fnv1a(payload, pages.size() * recordSize)};
+        memcpy(redoBuffer.data(), &header, sizeof(header));
+        writeFully(redoFd, redoBuffer.data(), redoBuffer.size(), 0);
+        fdatasync(redoFd);
+
+        for (const auto& page : pages) writePage(page.first, page.second);
+        sync();
+        clearRedoLog();
+    }
+
+public:
+    // The first reservedPages pages are allocated up front so that owners
+    // can place fixed headers there
+    PagedFile(BufferPool& bufferPool, const string& fileName,
+              const string& redoLogName, int reservedPages);
+    ~PagedFile();
+
+    int getPageCount() const {
+        return pageCount;
+    }
+
+    PageHandle fetch(int pageID);
+
+    // Appends a zeroed page and returns it pinned
+    PageHandle allocate(int& pageID);
+};
+
+// Set of page frames shared by every paged file. Victims are chosen with
+// the CLOCK algorithm among clean unpinned frames, so dirty pages stay
+// resident until the owner flushes them as one batch per file. A flush
+// never happens inside a command: when every frame is dirty or pinned the
+// pool grows, and overCapacity() asks for a flush at the next command
+// boundary, after which the extra frames are given back.
+class BufferPool {
+private:
+    struct Frame {
+        PagedFile* file;
+        int pageID;
+        int pinCount;
+        bool dirty;
+        bool referenced;
+        Page page;
+
+        Frame() : file(nullptr), pageID(-1), pinCount(0), dirty(false), referenced(false) {}
+    };
+
+    // A deque, so growing never moves the pages that handles point into
+    deque<Frame> frames;
+    size_t capacity;
+    unordered_map<long long, int> pageTable;
+    vector<PagedFile*> files;
+    vector<int> dirtyFrames;
+    int clockHand;
+    // Guards the pool once sessions run on several threads; a single
+    // session never takes it
+    mutex latch;
+    bool concurrent;
+
+    unique_lock<mutex> lockIfConcurrent() {
+        return concurrent ? unique_lock<mutex>(latch) : unique_lock<mutex>();
+    }
+
+    static long long pageKey(const PagedFile& file, int pageID) {
+        return ((long long)file.fileID << 32) | (unsigned int)pageID;
+    }
+
+    int findVictim() {
+        for (size_t step = 0; step < 2 * frames.size(); step++) {
+            int id = clockHand;
+            clockHand = (clockHand + 1) % frames.size();
+            Frame& frame = frames[id];
+            if (frame.pinCount > 0 || frame.dirty) continue;
+            if (frame.referenced) {
+                frame.referenced = false;
+                continue;
+            }
+            return id;
+        }
+        int id = frames.size();
+        frames.resize(frames.size() + MIN_FRAMES);
+        return id;
+    }
+
+    // Claims a frame for (file, pageID), evicting its previous page
+    int claimFrame(PagedFile& file, int pageID) {
+        int id = findVictim();
+        Frame& frame = frames[id];
+        if (frame.file) {
+            pageTable.erase(pageKey(*frame.file, frame.pageID));
+        }
+        frame.file = &file;
+        frame.pageID = pageID;
+        frame.dirty = false;
+        pageTable[pageKey(file, pageID)] = id;
+        return id;
+    }
+
+    PageHandle pin(int id) {
+        Frame& frame = frames[id];
+        frame.pinCount++;
+        frame.referenced = true;
+        return PageHandle(this, id, frame.page.data);
+    }
+
+public:
+    static constexpr int MIN_FRAMES = 16;
+
+    explicit BufferPool(int frameCount)
+        : frames(max(frameCount, MIN_FRAMES)), capacity(frames.size()), clockHand(0), concurrent(false) {
+        pageTable.reserve(frames.size() * 2);
+    }
+
+    // Called before sessions start running on several threads
+    void enableConcurrency() {
+        concurrent = true;
+    }
+
+    int registerFile(PagedFile* file) {
+        files.push_back(file);
+        return files.size() - 1;
+    }
+
+    PageHandle fetch(PagedFile& file, int pageID) {
+        auto lock = lockIfConcurrent();
+        auto it = pageTable.find(pageKey(file, pageID));
+        if (it != pageTable.end()) return pin(it->second);
+
+        int id = claimFrame(file, pageID);
+        file.readPage(pageID, frames[id].page.data);
+        return pin(id);
+    }
+
+    PageHandle create(PagedFile& file, int pageID) {
+        auto lock = lockIfConcurrent();
+        int id = claimFrame(file, pageID);
+        memset(frames[id].page.data, 0, PAGE_SIZE);
+        markFrameDirty(id);
+        return pin(id);
+    }
+
+    void unpin(int id) {
+        auto lock = lockIfConcurrent();
+        frames[id].pinCount--;
+    }
+
+    void markDirty(int id) {
+        auto lock = lockIfConcurrent();
+        markFrameDirty(id);
+    }
+
+    bool hasDirtyPages() {
+        auto lock = lockIfConcurrent();
+        return !dirtyFrames.empty();
+    }
+
+    // Whether the pool grew because too many pages were dirty
+    bool overCapacity() {
+        auto lock = lockIfConcurrent();
+        return frames.size() > capacity;
+    }
+
+    // Writes every dirty page back to its file, one batch per file
+    void flush() {
+        auto lock = lockIfConcurrent();
+        flushFrames();
+    }
+
+    // Writes back and forgets every page of a file that is being closed
+    void release(PagedFile& file) {
+        auto lock = lockIfConcurrent();
+        flushFrames();
+        for (size_t id = 0; id < frames.size(); id++) {
+            Frame& frame = frames[id];
+            if (frame.file != &file) continue;
+            pageTable.erase(pageKey(file, frame.pageID));
+            frame = Frame();
+        }
+        files[file.fileID] = nullptr;
+    }
+
+private:
+    void markFrameDirty(int id) {
+        Frame& frame = frames[id];
+        if (frame.dirty) return;
+        frame.dirty = true;
+        dirtyFrames.push_back(id);
+    }
+
+    void flushFrames() {
+        if (!dirtyFrames.empty()) writeDirtyFrames();
+
+        // Frames added under pressure go once their pages are clean
+        while (frames.size() > capacity && frames.back().pinCount == 0) {
+            Frame& frame = frames.back();
+            if (frame.file) pageTable.erase(pageKey(*frame.file, frame.pageID));
+            frames.pop_back();
+        }
+        if (clockHand >= (int)frames.size()) clockHand = 0;
+    }
+
+    void writeDirtyFrames() {
+        vector<pair<int, const char*>> batch;
+        for (PagedFile* file : files) {
+            if (!file) continue;
+            batch.clear();
+            for (int id : dirtyFrames) {
+                Frame& frame = frames[id];
+                if (frame.file == file) batch.push_back({frame.pageID, frame.page.data});
+            }
+            if (!batch.empty()) file->writeBatch(batch);
+        }
+        // A pinned page may still be modified by its holder, so it stays
+        // dirty and is written again by the next flush
+        vector<int> stillDirty;
+        for (int id : dirtyFrames) {
+            if (frames[id].pinCount > 0) {
+                stillDirty.push_back(id);
+            } else {
+                frames[id].dirty = false;
+            }
+        }
+        dirtyFrames.swap(stillDirty);
+    }
+};
+
+PageHandle& PageHandle::operator=(PageHandle&& other) {
+    if (this != &other) {
+        if (pool) pool->unpin(frame);
+        pool = other.pool;
+        frame = other.frame;
+        bytes = other.bytes;
+        other.pool = nullptr;
+    }
+    return *this;
+}
+
+PageHandle::~PageHandle() {
+    if (pool) pool->unpin(frame);
+}
+
+void PageHandle::markDirty() {
+    pool->markDirty(frame);
+}
+
+PagedFile::PagedFile(BufferPool& bufferPool, const string& fileName,
+                     const string& redoLogName, int reservedPages)
+    : pool(bufferPool), fd(openDataFile(fileName)), redoFd(openDataFile(redoLogName)), pageCount(0) {
+    struct stat info;
+    fstat(fd, &info);
+    pageCount = info.st_size / PAGE_SIZE;
+    recover();
+    fileID = pool.registerFile(this);
+    int pageID;
+    while (pageCount < reservedPages) allocate(pageID);
+}
+
+PagedFile::~PagedFile() {
+    pool.release(*this);
+    close(fd);
+    close(redoFd);
+}
+
+PageHandle PagedFile::fetch(int pageID) {
+    return pool.fetch(*this, pageID);
+}
+
+PageHandle PagedFile::allocate(int& pageID) {
+    pageID = pageCount++;
+    return pool.create(*this, pageID);
+}
+
+// Single-file database. Page 0 is the superblock: it holds a directory of
+// named segments, each of which owns one header page from which the segment
+// reaches the rest of its pages. Segments only grow, so pages are never
+// returned to the file.
+class Database {
+private:
+    static const int DATABASE_MAGIC = 0x42534449;
+    static const int SEGMENT_NAME_LEN = 28;
+
+    struct SegmentEntry {
+        char name[SEGMENT_NAME_LEN];
+        int headerPage;
+    };
+
+    static const int MAX_SEGMENTS = (PAGE_SIZE - 2 * sizeof(int)) / sizeof(SegmentEntry);
+
+    struct Superblock {
+        int magic;
+        int segmentCount;
+        SegmentEntry segments[MAX_SEGMENTS];
+    };
+
+    static_assert(sizeof(Superblock) <= PAGE_SIZE, "superblock exceeds page size");
+
+    PagedFile file;
+    Superblock superblock;
+
+    void saveSuperblock() {
+        PageHandle page = file.fetch(0);
+        memcpy(page.data(), &superblock, sizeof(superblock));
+        page.markDirty();
+    }
+
+public:
+    Database(BufferPool& pool, const string& fileName, const string& redoLogName)
+        : file(pool, fileName, redoLogName, 1) {
+        {
+            PageHandle page = file.fetch(0);
+            memcpy(&superblock, page.data(), sizeof(superblock));
+        }
+        if (superblock.magic == DATABASE_MAGIC) return;
+
+        memset(&superblock, 0, sizeof(superblock));
+        superblock.magic = DATABASE_MAGIC;
+        saveSuperblock();
+    }
+
+    PageHandle fetch(int pageID) {
+        return file.fetch(pageID);
+    }
+
+    // Returns a zeroed page appended to the file
+    PageHandle allocate(int& pageID) {
+        return file.allocate(pageID);
+    }
+
+    // Returns the header page of the named segment, creating the segment
+    // with a zeroed header on first use
+    int segment(const string& name) {
+        for (int i = 0; i < superblock.segmentCount; i++) {
+            if (name == superblock.segments[i].name) return superblock.segments[i].headerPage;
+        }
+        if (superblock.segmentCount == MAX_SEGMENTS || name.length() >= SEGMENT_NAME_LEN) {
+            throw runtime_error("cannot create segment " + name);
+        }
+
+        SegmentEntry& entry = superblock.segments[superblock.segmentCount++];
+        strcpy(entry.name, name.c_str());
+        allocate(entry.headerPage);
+        saveSuperblock();
+        return entry.headerPage;
+    }
+};
+
+// Segment holding a growable list of data pages addressed by position.
+// The header page lists directory pages, each of which lists data pages.
+class PageArray {
+private:
+    static const int IDS_PER_PAGE = PAGE_SIZE / sizeof(int);
+    static const int MAX_DIRECTORIES = IDS_PER_PAGE - 1;
+
+    struct ArrayHeader {
+        int count;
+        int directories[MAX_DIRECTORIES];
+    };
+
+    Database& db;
+    int headerPage;
+    int count;
+
+public:
+    PageArray(Database& database, const string& name)
+        : db(database), headerPage(database.segment(name)) {
+        PageHandle header = db.fetch(headerPage);
+        count = reinterpret_cast<ArrayHeader*>(header.data())->count;
+    }
+
+    int size() const {
+        return count;
+    }
+
+    PageHandle fetch(int index) {
+        PageHandle header = db.fetch(headerPage);
+        int directoryID = reinterpret_cast<ArrayHeader*>(header.data())->directories[index / IDS_PER_PAGE];
+        PageHandle directory = db.fetch(directoryID);
+        return db.fetch(reinterpret_cast<int*>(directory.data())[index % IDS_PER_PAGE]);
+    }
+
+    // Adds a zeroed page at position size() and returns it pinned
+    PageHandle append() {
+        if (count / IDS_PER_PAGE == MAX_DIRECTORIES) throw runtime_error("page array is full");
+
+        PageHandle header = db.fetch(headerPage);
+        ArrayHeader* arrayHeader = reinterpret_cast<ArrayHeader*>(header.data());
+        if (count % IDS_PER_PAGE == 0) {
+            db.allocate(arrayHeader->directories[count / IDS_PER_PAGE]);
+        }
+        PageHandle directory = db.fetch(arrayHeader->directories[count / IDS_PER_PAGE]);
+        int pageID;
+        PageHandle page = db.allocate(pageID);
+        reinterpret_cast<int*>(directory.data())[count % IDS_PER_PAGE] = pageID;
+        directory.markDirty();
+        arrayHeader->count = ++count;
+        header.markDirty();
+        return page;
+    }
+
+    // Pins the page at index, appending pages up to it if needed
+    PageHandle fetchOrAppend(int index) {
+        while (count < index) append();
+        if (index < count) return fetch(index);
+        return append();
+    }
+};
+
+// Fixed-length string usable as an on-disk key
+template <int N>
+struct FixedString {
+    char data[N];
+
+    FixedString() {
+        memset(data, 0, sizeof(data));
+    }
+
+    FixedString(string_view s) {
+        memset(data, 0, sizeof(data));
+        memcpy(data, s.data(), min(s.length(), (size_t)N - 1));
+    }
+
+    bool operator<(const FixedString& other) const {
+        return strcmp(data, other.data) < 0;
+    }
+
+    bool operator==(const FixedString& other) const {
+        return strcmp(data, other.data) == 0;
+    }
+};
+
+typedef FixedString<21> ISBNKey;
+typedef FixedString<31> UserIDKey;
+
+typedef FixedString<61> TextKey;
+
+// Secondary index entry: the string id of an attribute value paired with
+// the ISBN holding it, so entries for one value are contiguous and already
+// in ISBN order
+struct IndexKey {
+    int value;
+    ISBNKey ISBN;
+
+    IndexKey() : value(0) {}
+
+    IndexKey(int v, string_view isbn) : value(v), ISBN(isbn) {}
+
+    bool operator<(const IndexKey& other) const {
+        if (value != other.value) return value < other.value;
+        return ISBN < other.ISBN;
+    }
+
+    bool operator==(const IndexKey& other) const {
+        return value == other.value && ISBN == other.ISBN;
+    }
 };
 
-// Account Manager
-class AccountManager {
-private:
-    map<string, Account> accounts;
-    
-    void loadAccounts() {
-        ifstream file(ACCOUNT_FILE, ios::binary);
-        if (!file) return;
-        
-        int count;
-        file.read((char*)&count, sizeof(count));
-        for (int i = 0; i < count; i++) {
-            Account acc;
-            file.read((char*)&acc, sizeof(acc));
-            accounts[acc.userID] = acc;
+// Disk-resident B+ tree stored as a database segment. The tree header lives
+// in the segment's header page and every other page the tree allocates is
+// one node. Erase is lazy: entries
+// are removed from their leaf without merging, so separators stay valid
+// upper bounds.
+template <class Key, class Value>
+class BPlusTree {
+private:
+    static const int TREE_MAGIC = 0x42505431;
+
+    struct TreeHeader {
+        int magic;
+        int root;
+        int firstLeaf;
+    };
+
+    struct NodeHeader {
+        int isLeaf;
+        int count;
+        int next;
+    };
+
+    static const int LEAF_CAPACITY = (PAGE_SIZE - 64) / (sizeof(Key) + sizeof(Value));
+    static const int INTERNAL_CAPACITY = (PAGE_SIZE - 64) / (sizeof(Key) + sizeof(int)) - 1;
+
+    struct LeafNode {
+        NodeHeader header;
+        Key keys[LEAF_CAPACITY];
+        Value values[LEAF_CAPACITY];
+    };
+
+    struct InternalNode {
+        NodeHeader header;
+        Key keys[INTERNAL_CAPACITY];
+        int children[INTERNAL_CAPACITY + 1];
+    };
+
+    static_assert(sizeof(LeafNode) <= PAGE_SIZE, "leaf node exceeds page size");
+    static_assert(sizeof(InternalNode) <= PAGE_SIZE, "internal node exceeds page size");
+
+    Database& db;
+    int headerPage;
+    TreeHeader treeHeader;
+
+    static LeafNode* asLeaf(PageHandle& page) {
+        return reinterpret_cast<LeafNode*>(page.data());
+    }
+
+    static InternalNode* asInternal(PageHandle& page) {
+        return reinterpret_cast<InternalNode*>(page.data());
+    }
+
+    static NodeHeader* asNode(PageHandle& page) {
+        return reinterpret_cast<NodeHeader*>(page.data());
+    }
+
+    void saveHeader() {
+        PageHandle page = db.fetch(headerPage);
+        memcpy(page.data(), &treeHeader, sizeof(treeHeader));
+        page.markDirty();
+    }
+
+    // Descends from the root and pins the leaf that may contain key
+    PageHandle findLeaf(const Key& key) {
+        PageHandle page = db.fetch(treeHeader.root);
+        while (!asNode(page)->isLeaf) {
+            InternalNode* node = asInternal(page);
+            int i = upper_bound(node->keys, node->keys + node->header.count, key) - node->keys;
+            page = db.fetch(node->children[i]);
+        }
+        return page;
+    }
+
+    // Inserts into the subtree rooted at pageID. Returns true if the node
+    // split, in which case separator and newPage describe the right half.
+    bool insertInto(int pageID, const Key& key, const Value& value,
+                    bool& inserted, Key& separator, int& newPage) {
+        PageHandle page = db.fetch(pageID);
+
+        if (asNode(page)->isLeaf) {
+            LeafNode* leaf = asLeaf(page);
+            int count = leaf->header.count;
+            int pos = lower_bound(leaf->keys, leaf->keys + count, key) - leaf->keys;
+            if (pos < count && leaf->keys[pos] == key) {
+                inserted = false;
+                return false;
+            }
+            inserted = true;
+            page.markDirty();
+
+            if (count < LEAF_CAPACITY) {
+                for (int i = count; i > pos; i--) {
+                    leaf->keys[i] = leaf->keys[i - 1];
+                    leaf->values[i] = leaf->values[i - 1];
+                }
+                leaf->keys[pos] = key;
+                leaf->values[pos] = value;
+                leaf->header.count++;
+                return false;
+            }
+
+            vector<Key> keys(leaf->keys, leaf->keys + count);
+            vector<Value> values(leaf->values, leaf->values + count);
+            keys.insert(keys.begin() + pos, key);
+            values.insert(values.begin() + pos, value);
+
+            PageHandle rightPage = db.allocate(newPage);
+            LeafNode* right = asLeaf(rightPage);
+            int leftCount = keys.size() / 2;
+            right->header.isLeaf = 1;
+            right->header.count = keys.size() - leftCount;
+            right->header.next = leaf->header.next;
+            for (int i = 0; i < right->header.count; i++) {
+                right->keys[i] = keys[leftCount + i];
+                right->values[i] = values[leftCount + i];
+            }
+            leaf->header.count = leftCount;
+            leaf->header.next = newPage;
+            for (int i = 0; i < leftCount; i++) {
+                leaf->keys[i] = keys[i];
+                leaf->values[i] = values[i];
+            }
+            separator = right->keys[0];
+            return true;
+        }
+
+        InternalNode* node = asInternal(page);
+        int count = node->header.count;
+        int pos = upper_bound(node->keys, node->keys + count, key) - node->keys;
+        Key childSeparator;
+        int childPage;
+        if (!insertInto(node->children[pos], key, value, inserted, childSeparator, childPage)) {
+            return false;
+        }
+        page.markDirty();
+
+        if (count < INTERNAL_CAPACITY) {
+            for (int i = count; i > pos; i--) {
+                node->keys[i] = node->keys[i - 1];
+                node->children[i + 1] = node->children[i];
+            }
+            node->keys[pos] = childSeparator;
+            node->children[pos + 1] = childPage;
+            node->header.count++;
+            return false;
+        }
+
+        vector<Key> keys(node->keys, node->keys + count);
+        vector<int> children(node->children, node->children + count + 1);
+        keys.insert(keys.begin() + pos, childSeparator);
+        children.insert(children.begin() + pos + 1, childPage);
+
+        PageHandle rightPage = db.allocate(newPage);
+        InternalNode* right = asInternal(rightPage);
+        int mid = keys.size() / 2;
+        right->header.isLeaf = 0;
+        right->header.count = keys.size() - mid - 1;
+        for (int i = 0; i < right->header.count; i++) {
+            right->keys[i] = keys[mid + 1 + i];
+        }
+        for (int i = 0; i <= right->header.count; i++) {
+            right->children[i] = children[mid + 1 + i];
+        }
+        node->header.count = mid;
+        for (int i = 0; i < mid; i++) {
+            node->keys[i] = keys[i];
+        }
+        for (int i = 0; i <= mid; i++) {
+            node->children[i] = children[i];
+        }
+        separator = keys[mid];
+        return true;
+    }
+
+public:
+    BPlusTree(Database& database, const string& name)
+        : db(database), headerPage(database.segment(name)) {
+        {
+            PageHandle page = db.fetch(headerPage);
+            memcpy(&treeHeader, page.data(), sizeof(treeHeader));
+        }
+        if (treeHeader.magic == TREE_MAGIC) return;
+
+        treeHeader.magic = TREE_MAGIC;
+        PageHandle rootPage = db.allocate(treeHeader.root);
+        treeHeader.firstLeaf = treeHeader.root;
+        asLeaf(rootPage)->header.isLeaf = 1;
+        asLeaf(rootPage)->header.next = -1;
+        saveHeader();
+    }
+
+    bool find(const Key& key, Value& value) {
+        PageHandle page = findLeaf(key);
+        LeafNode* leaf = asLeaf(page);
+        int count = leaf->header.count;
+        int pos = lower_bound(leaf->keys, leaf->keys + count, key) - leaf->keys;
+        if (pos == count || !(leaf->keys[pos] == key)) return false;
+        value = leaf->values[pos];
+        return true;
+    }
+
+    bool insert(const Key& key, const Value& value) {
+        bool inserted = false;
+        Key separator;
+        int newPage;
+        if (insertInto(treeHeader.root, key, value, inserted, separator, newPage)) {
+            int rootID;
+            PageHandle rootPage = db.allocate(rootID);
+            InternalNode* root = asInternal(rootPage);
+            root->header.isLeaf = 0;
+            root->header.count = 1;
+            root->keys[0] = separator;
+            root->children[0] = treeHeader.root;
+            root->children[1] = newPage;
+            treeHeader.root = rootID;
+            saveHeader();
+        }
+        return inserted;
+    }
+
+    // Overwrites the value of an existing key, touching only its leaf page
+    bool update(const Key& key, const Value& value) {
+        PageHandle page = findLeaf(key);
+        LeafNode* leaf = asLeaf(page);
+        int count = leaf->header.count;
+        int pos = lower_bound(leaf->keys, leaf->keys + count, key) - leaf->keys;
+        if (pos == count || !(leaf->keys[pos] == key)) return false;
+        leaf->values[pos] = value;
+        page.markDirty();
+        return true;
+    }
+
+    bool erase(const Key& key) {
+        PageHandle page = findLeaf(key);
+        LeafNode* leaf = asLeaf(page);
+        int count = leaf->header.count;
+        int pos = lower_bound(leaf->keys, leaf->keys + count, key) - leaf->keys;
+        if (pos == count || !(leaf->keys[pos] == key)) return false;
+        for (int i = pos; i + 1 < count; i++) {
+            leaf->keys[i] = leaf->keys[i + 1];
+            leaf->values[i] = leaf->values[i + 1];
+        }
+        leaf->header.count--;
+        page.markDirty();
+        return true;
+    }
+
+    // Forward iterator over the leaf chain; keeps its current leaf pinned
+    class Cursor {
+    private:
+        Database* db;
+        PageHandle page;
+        int index;
+
+        // Moves past exhausted (or lazily emptied) leaves
+        void settle() {
+            while (asLeaf(page)->header.count <= index) {
+                int next = asLeaf(page)->header.next;
+                if (next == -1) {
+                    page = PageHandle();
+                    return;
+                }
+                page = db->fetch(next);
+                index = 0;
+            }
+        }
+
+    public:
+        Cursor(Database& database, int firstLeaf)
+            : db(&database), page(database.fetch(firstLeaf)), index(0) {
+            settle();
+        }
+
+        bool valid() {
+            return page.data() != nullptr;
+        }
+
+        const Key& key() {
+            return asLeaf(page)->keys[index];
+        }
+
+        const Value& value() {
+            return asLeaf(page)->values[index];
+        }
+
+        void next() {
+            index++;
+            settle();
+        }
+    };
+
+    Cursor begin() {
+        return Cursor(db, treeHeader.firstLeaf);
+    }
+
+    // Visits entries in key order by walking the leaf chain, until the
+    // visitor returns false
+    template <class Visitor>
+    void forEach(Visitor visit) {
+        for (int pageID = treeHeader.firstLeaf; pageID != -1;) {
+            PageHandle page = db.fetch(pageID);
+            LeafNode* leaf = asLeaf(page);
+            for (int i = 0; i < leaf->header.count; i++) {
+                if (!visit(leaf->keys[i], leaf->values[i])) return;
+            }
+            pageID = leaf->header.next;
+        }
+    }
+
+    // Visits entries with keys not less than from, in key order, until the
+    // visitor returns false
+    template <class Visitor>
+    void forEachFrom(const Key& from, Visitor visit) {
+        PageHandle page = findLeaf(from);
+        LeafNode* leaf = asLeaf(page);
+        int i = lower_bound(leaf->keys, leaf->keys + leaf->header.count, from) - leaf->keys;
+        while (true) {
+            for (; i < leaf->header.count; i++) {
+                if (!visit(leaf->keys[i], leaf->values[i])) return;
+            }
+            int next = leaf->header.next;
+            if (next == -1) return;
+            page = db.fetch(next);
+            leaf = asLeaf(page);
+            i = 0;
+        }
+    }
+};
+
+// FNV-1a over the used part of a fixed string
+template <int N>
+unsigned int hashKey(const FixedString<N>& key) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < N && key.data[i]; i++) {
+        hash = (hash ^ (unsigned char)key.data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Disk-resident extendible hash table stored as a database segment. The
+// segment is a PageArray whose first page holds the global depth and whose
+// other pages hold the directory of bucket page IDs; each bucket is one
+// page of unordered entries. The directory is also kept in memory, so a
+// lookup reads exactly one bucket page. Erase never merges buckets.
+template <class Key, class Value>
+class ExtendibleHash {
+private:
+    static const int MAX_DEPTH = 24;
+    static const int IDS_PER_PAGE = PAGE_SIZE / sizeof(int);
+
+    struct Entry {
+        Key key;
+        Value value;
+    };
+
+    struct BucketHeader {
+        int localDepth;
+        int count;
+    };
+
+    static const int BUCKET_CAPACITY = (PAGE_SIZE - sizeof(BucketHeader)) / sizeof(Entry);
+
+    struct Bucket {
+        BucketHeader header;
+        Entry entries[BUCKET_CAPACITY];
+    };
+
+    static_assert(sizeof(Bucket) <= PAGE_SIZE, "bucket exceeds page size");
+
+    Database& db;
+    PageArray directoryPages;
+    int globalDepth;
+    vector<int> directory;
+
+    static Bucket* asBucket(PageHandle& page) {
+        return reinterpret_cast<Bucket*>(page.data());
+    }
+
+    int bucketOf(unsigned int hash) const {
+        return directory[hash & ((1u << globalDepth) - 1)];
+    }
+
+    void saveDirectory() {
+        {
+            PageHandle header = directoryPages.fetch(0);
+            memcpy(header.data(), &globalDepth, sizeof(globalDepth));
+            header.markDirty();
+        }
+        for (size_t first = 0; first < directory.size(); first += IDS_PER_PAGE) {
+            PageHandle page = directoryPages.fetchOrAppend(1 + first / IDS_PER_PAGE);
+            size_t count = min(directory.size() - first, (size_t)IDS_PER_PAGE);
+            memcpy(page.data(), directory.data() + first, count * sizeof(int));
+            page.markDirty();
+        }
+    }
+
+    // Finds key in its bucket; returns the entry index or -1
+    static int locate(Bucket* bucket, const Key& key) {
+        for (int i = 0; i < bucket->header.count; i++) {
+            if (bucket->entries[i].key == key) return i;
+        }
+        return -1;
+    }
+
+    void split(int bucketID) {
+        PageHandle page = db.fetch(bucketID);
+        Bucket* bucket = asBucket(page);
+        int depth = bucket->header.localDepth;
+        if (depth == MAX_DEPTH) throw runtime_error("hash bucket cannot split further");
+
+        if (depth == globalDepth) {
+            size_t size = directory.size();
+            directory.resize(2 * size);
+            copy_n(directory.begin(), size, directory.begin() + size);
+            globalDepth++;
+        }
+
+        int newID;
+        PageHandle newPage = db.allocate(newID);
+        Bucket* sibling = asBucket(newPage);
+        bucket->header.localDepth = sibling->header.localDepth = depth + 1;
+
+        int kept = 0;
+        for (int i = 0; i < bucket->header.count; i++) {
+            const Entry& entry = bucket->entries[i];
+            if (hashKey(entry.key) >> depth & 1) {
+                sibling->entries[sibling->header.count++] = entry;
+            } else {
+                bucket->entries[kept++] = entry;
+            }
+        }
+        bucket->header.count = kept;
+        page.markDirty();
+
+        for (size_t i = 0; i < directory.size(); i++) {
+            if (directory[i] == bucketID && (i >> depth & 1)) directory[i] = newID;
+        }
+        saveDirectory();
+    }
+
+public:
+    ExtendibleHash(Database& database, const string& name)
+        : db(database), directoryPages(database, name), globalDepth(0) {
+        if (directoryPages.size() == 0) {
+            int bucketID;
+            db.allocate(bucketID);
+            directory.push_back(bucketID);
+            directoryPages.append();
+            saveDirectory();
+            return;
+        }
+
+        {
+            PageHandle header = directoryPages.fetch(0);
+            memcpy(&globalDepth, header.data(), sizeof(globalDepth));
+        }
+        directory.resize(1u << globalDepth);
+        for (size_t first = 0; first < directory.size(); first += IDS_PER_PAGE) {
+            PageHandle page = directoryPages.fetch(1 + first / IDS_PER_PAGE);
+            size_t count = min(directory.size() - first, (size_t)IDS_PER_PAGE);
+            memcpy(directory.data() + first, page.data(), count * sizeof(int));
+        }
+    }
+
+    bool find(const Key& key, Value& value) {
+        PageHandle page = db.fetch(bucketOf(hashKey(key)));
+        Bucket* bucket = asBucket(page);
+        int i = locate(bucket, key);
+        if (i == -1) return false;
+        value = bucket->entries[i].value;
+        return true;
+    }
+
+    bool insert(const Key& key, const Value& value) {
+        unsigned int hash = hashKey(key);
+        while (true) {
+            int bucketID = bucketOf(hash);
+            {
+                PageHandle page = db.fetch(bucketID);
+                Bucket* bucket = asBucket(page);
+                if (locate(bucket, key) != -1) return false;
+                if (bucket->header.count < BUCKET_CAPACITY) {
+                    bucket->entries[bucket->header.count++] = Entry{key, value};
+                    page.markDirty();
+                    return true;
+                }
+            }
+            split(bucketID);
+        }
+    }
+
+    bool erase(const Key& key) {
+        PageHandle page = db.fetch(bucketOf(hashKey(key)));
+        Bucket* bucket = asBucket(page);
+        int i = locate(bucket, key);
+        if (i == -1) return false;
+        bucket->entries[i] = bucket->entries[--bucket->header.count];
+        page.markDirty();
+        return true;
+    }
+};
+
+// Persisted blocked Bloom filter stored as a PageArray segment: page 0
+// holds counters and the rest are bit pages. A key's bits all lie in one
+// page chosen by its hash, so a probe pins a single page. Keys cannot be
+// removed, so deleted keys stay "maybe present" and only cost a probe.
+class BloomFilter {
+private:
+    static const int HASH_COUNT = 7;
+    static const unsigned int BITS_PER_PAGE = PAGE_SIZE * 8;
+
+    struct FilterHeader {
+        int keyCount;
+    };
+
+    PageArray pages;
+    int bitPages;
+    FilterHeader filterHeader;
+    // Counted from concurrent sessions too, so they are atomic
+    atomic<long long> probes;
+    atomic<long long> rejections;
+    atomic<long long> falsePositives;
+
+    static unsigned long long hash(string_view key) {
+        unsigned long long h = 14695981039346656037ull;
+        for (char c : key) h = (h ^ (unsigned char)c) * 1099511628211ull;
+        return h;
+    }
+
+    // Calls visit with the byte and mask of each of the key's bits
+    template <class Visitor>
+    bool forEachBit(PageHandle& page, unsigned long long h, Visitor visit) {
+        unsigned int a = h, b = h >> 32, step = (a >> 8) | 1;
+        for (int i = 0; i < HASH_COUNT; i++) {
+            unsigned int bit = (b + i * step) % BITS_PER_PAGE;
+            if (!visit(page.data()[bit / 8], (char)(1 << bit % 8))) return false;
+        }
+        return true;
+    }
+
+    PageHandle blockOf(unsigned long long h) {
+        return pages.fetch(1 + (unsigned int)h % bitPages);
+    }
+
+public:
+    BloomFilter(Database& db, const string& name, int pageCount)
+        : pages(db, name), bitPages(pageCount), probes(0), rejections(0), falsePositives(0) {
+        PageHandle header = pages.fetchOrAppend(0);
+        memcpy(&filterHeader, header.data(), sizeof(filterHeader));
+        // The size of an existing filter is fixed when it is created
+        if (pages.size() > 1) bitPages = pages.size() - 1;
+        while (pages.size() < 1 + bitPages) pages.append();
+    }
+
+    void add(string_view key) {
+        unsigned long long h = hash(key);
+        PageHandle page = blockOf(h);
+        forEachBit(page, h, [](char& byte, char mask) {
+            byte |= mask;
+            return true;
+        });
+        page.markDirty();
+
+        filterHeader.keyCount++;
+        PageHandle header = pages.fetch(0);
+        memcpy(header.data(), &filterHeader, sizeof(filterHeader));
+        header.markDirty();
+    }
+
+    // False means the key was never added
+    bool mayContain(string_view key) {
+        probes.fetch_add(1, memory_order_relaxed);
+        unsigned long long h = hash(key);
+        PageHandle page = blockOf(h);
+        bool maybe = forEachBit(page, h, [](char& byte, char mask) {
+            return (byte & mask) != 0;
+        });
+        if (!maybe) rejections.fetch_add(1, memory_order_relaxed);
+        return maybe;
+    }
+
+    // Reports that a key the filter let through was not there after all
+    void recordFalsePositive() {
+        falsePositives.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Expected rate for the current number of keys, (1 - e^(-kn/m))^k
+    double estimatedFalsePositiveRate() const {
+        double m = (double)bitPages * BITS_PER_PAGE;
+        return pow(1 - exp(-HASH_COUNT * filterHeader.keyCount / m), HASH_COUNT);
+    }
+
+    // Fraction of absent keys the filter failed to reject
+    double observedFalsePositiveRate() const {
+        long long absent = rejections + falsePositives;
+        return absent == 0 ? 0 : (double)falsePositives / absent;
+    }
+
+    void reportStats(const char* label) const {
+        fprintf(stderr, "%s: %d keys, %lld probes, %lld rejected, %lld false positives, "
+                        "observed rate %.6f, estimated rate %.6f\n",
+                label, filterHeader.keyCount, probes.load(), rejections.load(), falsePositives.load(),
+                observedFalsePositiveRate(), estimatedFalsePositiveRate());
+    }
+};
+
+// Interned strings shared by all records. Each distinct string is stored
+// once in the string_heap segment as a length byte followed by its bytes,
+// never crossing a page, and its id is its byte offset there. Id 0 is the
+// empty string. The string_dictionary tree maps text back to its id.
+// Strings are never freed.
+class StringHeap {
+private:
+    static const int MAX_LENGTH = 60;
+
+    PageArray heap;
+    BPlusTree<TextKey, int> dictionary;
+    int end;
+
+    void saveEnd() {
+        PageHandle header = heap.fetch(0);
+        memcpy(header.data(), &end, sizeof(end));
+        header.markDirty();
+    }
+
+public:
+    explicit StringHeap(Database& db) : heap(db, "string_heap"), dictionary(db, "string_dictionary") {
+        PageHandle header = heap.fetchOrAppend(0);
+        memcpy(&end, header.data(), sizeof(end));
+        // Data starts on page 1, so no string has id 0
+        if (end == 0) end = PAGE_SIZE;
+    }
+
+    // Returns the id of an existing string without adding it
+    bool find(string_view text, int& id) {
+        if (text.empty()) {
+            id = 0;
+            return true;
+        }
+        return dictionary.find(text, id);
+    }
+
+    int intern(string_view text) {
+        text = text.substr(0, MAX_LENGTH);
+        int id;
+        if (find(text, id)) return id;
+
+        if (end % PAGE_SIZE + 1 + text.length() > PAGE_SIZE) {
+            end = (end / PAGE_SIZE + 1) * PAGE_SIZE;
+        }
+        id = end;
+        PageHandle page = heap.fetchOrAppend(id / PAGE_SIZE);
+        char* entry = page.data() + id % PAGE_SIZE;
+        entry[0] = (char)text.length();
+        memcpy(entry + 1, text.data(), text.length());
+        page.markDirty();
+        end += 1 + text.length();
+        saveEnd();
+        dictionary.insert(text, id);
+        return id;
+    }
+
+    // Copies the string with the given id into a zero-terminated field
+    template <size_t N>
+    void read(int id, char (&field)[N]) {
+        if (id == 0) {
+            field[0] = 0;
+            return;
+        }
+        PageHandle page = heap.fetch(id / PAGE_SIZE);
+        const char* entry = page.data() + id % PAGE_SIZE;
+        copyField(field, string_view(entry + 1, (unsigned char)entry[0]));
+    }
+};
+
+// An account together with the slot holding it
+struct AccountRecord {
+    int slot;
+    Account account;
+};
+
+// Account Manager
+// The accounts segment is a header page followed by pages of fixed 70-byte
+// slots whose username is a StringHeap id. A deleted slot becomes a tombstone (empty userID) whose privilege
+// field links the free list; the account_index hash table maps every
+// userID to its slot.
+class AccountManager {
+private:
+    static const int ACCOUNT_MAGIC = 0x41434333;
+    static const int FIELD_LEN = 31;
+    static const int RECORD_SIZE = FIELD_LEN * 2 + sizeof(int) * 2;
+    static const int SLOTS_PER_PAGE = PAGE_SIZE / RECORD_SIZE;
+
+    struct FileHeader {
+        int magic;
+        int slotCount;
+        int freeHead;
+    };
+
+    StringHeap& strings;
+    PageArray slots;
+    FileHeader fileHeader;
+    ExtendibleHash<UserIDKey, int> index;
+    BloomFilter filter;
+
+    // Pins the page holding slot, growing the segment if the slot is new
+    PageHandle fetchSlotPage(int slot, int& offset) {
+        offset = slot % SLOTS_PER_PAGE * RECORD_SIZE;
+        return slots.fetchOrAppend(1 + slot / SLOTS_PER_PAGE);
+    }
+
+    void saveHeader() {
+        PageHandle page = slots.fetch(0);
+        memcpy(page.data(), &fileHeader, sizeof(fileHeader));
+        page.markDirty();
+    }
+
+    void readSlot(int slot, Account& acc) {
+        int offset;
+        PageHandle page = fetchSlotPage(slot, offset);
+        const char* record = page.data() + offset;
+        memcpy(acc.userID, record, FIELD_LEN);
+        memcpy(acc.password, record + FIELD_LEN, FIELD_LEN);
+        memcpy(&acc.username, record + FIELD_LEN * 2, sizeof(int));
+        memcpy(&acc.privilege, record + FIELD_LEN * 2 + sizeof(int), sizeof(int));
+    }
+
+    void writeSlot(int slot, const Account& acc) {
+        int offset;
+        PageHandle page = fetchSlotPage(slot, offset);
+        char* record = page.data() + offset;
+        memcpy(record, acc.userID, FIELD_LEN);
+        memcpy(record + FIELD_LEN, acc.password, FIELD_LEN);
+        memcpy(record + FIELD_LEN * 2, &acc.username, sizeof(int));
+        memcpy(record + FIELD_LEN * 2 + sizeof(int), &acc.privilege, sizeof(int));
+        page.markDirty();
+    }
+
+public:
+    AccountManager(Database& db, StringHeap& heap)
+        : strings(heap),
+          slots(db, "accounts"),
+          index(db, "account_index"),
+          filter(db, "account_filter", BLOOM_FILTER_PAGES) {
+        {
+            PageHandle page = slots.fetchOrAppend(0);
+            memcpy(&fileHeader, page.data(), sizeof(fileHeader));
+        }
+        if (fileHeader.magic != ACCOUNT_MAGIC) {
+            fileHeader.magic = ACCOUNT_MAGIC;
+            fileHeader.slotCount = 0;
+            fileHeader.freeHead = -1;
+            saveHeader();
+        }
+
+        if (!exists("root")) {
+            addAccount("root", "sjtu", 7, "root");
+        }
+    }
+
+    bool addAccount(string_view userID, string_view password,
+                    int privilege, string_view username) {
+        if (exists(userID)) return false;
+
+        int slot;
+        if (fileHeader.freeHead != -1) {
+            Account tombstone;
+            slot = fileHeader.freeHead;
+            readSlot(slot, tombstone);
+            fileHeader.freeHead = tombstone.privilege;
+        } else {
+            slot = fileHeader.slotCount++;
+        }
+        saveHeader();
+
+        Account acc;
+        copyField(acc.userID, userID);
+        copyField(acc.password, password);
+        acc.username = strings.intern(username);
+        acc.privilege = privilege;
+        writeSlot(slot, acc);
+        index.insert(userID, slot);
+        filter.add(userID);
+        return true;
+    }
+
+    // Looks an account up once; the record can then be used and changed
+    // without another index lookup
+    bool find(string_view userID, AccountRecord& record) {
+        if (!filter.mayContain(userID)) return false;
+        if (!index.find(userID, record.slot)) {
+            filter.recordFalsePositive();
+            return false;
+        }
+        readSlot(record.slot, record.account);
+        return true;
+    }
+
+    void deleteAccount(const AccountRecord& record) {
+        Account tombstone;
+        tombstone.privilege = fileHeader.freeHead;
+        writeSlot(record.slot, tombstone);
+        fileHeader.freeHead = record.slot;
+        saveHeader();
+        index.erase(UserIDKey(record.account.userID));
+    }
+
+    void changePassword(AccountRecord& record, string_view newPassword) {
+        memset(record.account.password, 0, sizeof(record.account.password));
+        copyField(record.account.password, newPassword);
+        writeSlot(record.slot, record.account);
+    }
+
+    bool exists(string_view userID) {
+        if (!filter.mayContain(userID)) return false;
+        int slot;
+        if (index.find(userID, slot)) return true;
+        filter.recordFalsePositive();
+        return false;
+    }
+
+    const BloomFilter& getFilter() const {
+        return filter;
+    }
+};
+
+enum BookQuery { QUERY_ALL, QUERY_ISBN, QUERY_NAME, QUERY_AUTHOR, QUERY_KEYWORD };
+
+// Book Manager
+// Each book is split across two trees keyed by ISBN: book_stock holds the
+// small, frequently written price and quantity, and book_info holds the
+// descriptive strings, so buy and import only dirty compact stock pages.
+// Secondary trees for name, author and keyword segments live in their own
+// database segments.
+//
+// Searches read a snapshot. When sessions run concurrently, buy and import
+// may rewrite stock values while searches are running (every other change
+// waits for them to finish, and buy and import wait for each other). Each
+// of those writes first appends the value it replaces to an in-memory
+// version list, then overwrites the stock, then counts itself applied. A
+// search opened when P writes were applied reads versions from position P
+// on, as they are appended, without taking any latch. Per book, the oldest
+// of them holds the stock as it was at P. Chunks of the list are freed once
+// every open snapshot starts after them.
+class BookManager {
+private:
+    struct BookStock {
+        Money price;
+        int quantity;
+    };
+
+    // The stock a book had before one write
+    struct StockVersion {
+        ISBNKey ISBN;
+        BookStock before;
+    };
+
+    static const int VERSION_CHUNK = 1024;
+
+    // A piece of the version list. The writer fills entries in order and
+    // publishes them through used; next is linked before the last entry is
+    // published, so a reader at the end of a full chunk can always move on.
+    struct VersionChunk {
+        long long base;
+        atomic<int> used;
+        atomic<VersionChunk*> next;
+        StockVersion entries[VERSION_CHUNK];
+
+        explicit VersionChunk(long long first) : base(first), used(0), next(nullptr) {}
+    };
+
+public:
+    // What one search has read of the version list, and the oldest value
+    // seen for each book written after it opened
+    struct StockSnapshot {
+        VersionChunk* chunk;  // null when sessions do not run concurrently
+        int index;
+        long long position;
+        map<ISBNKey, BookStock> older;
+    };
+
+private:
+
+    // StringHeap ids; keyword is the whole "a|b" string
+    struct BookInfo {
+        int name;
+        int author;
+        int keyword;
+    };
+
+    StringHeap& strings;
+    BPlusTree<ISBNKey, BookStock> stock;
+    BPlusTree<ISBNKey, BookInfo> info;
+    BPlusTree<IndexKey, char> nameIndex;
+    BPlusTree<IndexKey, char> authorIndex;
+    BPlusTree<IndexKey, char> keywordIndex;
+    BloomFilter filter;
+
+    // The version list exists only once sessions run concurrently. Writers
+    // append without a latch; versionLatch guards the set of open snapshots
+    // and freeing chunks, which happen once per search or per chunk.
+    bool concurrent;
+    mutex versionLatch;
+    VersionChunk* oldestChunk;
+    atomic<VersionChunk*> newestChunk;
+    atomic<long long> applied;
+    multiset<long long> snapshots;
+
+    // Frees the chunks every open snapshot starts after; versionLatch held
+    void collectVersions() {
+        long long oldest = snapshots.empty() ? applied.load(memory_order_acquire) : *snapshots.begin();
+        while (oldestChunk != newestChunk.load(memory_order_acquire) &&
+               oldestChunk->base + VERSION_CHUNK <= oldest) {
+            VersionChunk* dead = oldestChunk;
+            oldestChunk = dead->next.load(memory_order_acquire);
+            delete dead;
+        }
+    }
+
+    // Overwrites a book's stock. Under concurrency the old value is
+    // published first, so a search that reads the new value also finds the
+    // old one.
+    void replaceStock(string_view ISBN, const BookStock& before, const BookStock& after) {
+        if (!concurrent) {
+            stock.update(ISBN, after);
+            return;
+        }
+        VersionChunk* chunk = newestChunk.load(memory_order_relaxed);
+        int slot = chunk->used.load(memory_order_relaxed);
+        VersionChunk* following = nullptr;
+        if (slot == VERSION_CHUNK - 1) {
+            following = new VersionChunk(chunk->base + VERSION_CHUNK);
+            chunk->next.store(following, memory_order_release);
+        }
+        chunk->entries[slot] = StockVersion{ISBN, before};
+        chunk->used.store(slot + 1, memory_order_release);
+        atomic_thread_fence(memory_order_seq_cst);
+        stock.update(ISBN, after);
+        applied.store(chunk->base + slot + 1, memory_order_release);
+        if (following) {
+            newestChunk.store(following, memory_order_release);
+            lock_guard<mutex> lock(versionLatch);
+            collectVersions();
+        }
+    }
+
+    // The stock a book had when snapshot opened, given a copy of the value
+    // just read from the tree; a reference into the page could change after
+    // the versions are checked. Versions appended since the last call are
+    // taken in first, keeping the oldest per book.
+    BookStock stockAt(const ISBNKey& ISBN, BookStock stored, StockSnapshot& snapshot) {
+        if (!snapshot.chunk) return stored;
+        atomic_thread_fence(memory_order_seq_cst);
+        while (true) {
+            VersionChunk* chunk = snapshot.chunk;
+            int used = chunk->used.load(memory_order_acquire);
+            for (; snapshot.index < used; snapshot.index++) {
+                const StockVersion& version = chunk->entries[snapshot.index];
+                snapshot.older.emplace(version.ISBN, version.before);
+            }
+            if (snapshot.index < VERSION_CHUNK) break;
+            snapshot.chunk = chunk->next.load(memory_order_acquire);
+            snapshot.index = 0;
+        }
+        if (snapshot.older.empty()) return stored;
+        auto older = snapshot.older.find(ISBN);
+        return older == snapshot.older.end() ? stored : older->second;
+    }
+
+    void openSnapshot(StockSnapshot& snapshot) {
+        snapshot.chunk = nullptr;
+        if (!concurrent) return;
+        lock_guard<mutex> lock(versionLatch);
+        // The newest chunk is loaded first, so it starts at or before the
+        // applied count read after it
+        VersionChunk* chunk = newestChunk.load(memory_order_acquire);
+        snapshot.position = applied.load(memory_order_acquire);
+        long long index = snapshot.position - chunk->base;
+        while (index >= VERSION_CHUNK) {
+            chunk = chunk->next.load(memory_order_acquire);
+            index -= VERSION_CHUNK;
+        }
+        snapshot.chunk = chunk;
+        snapshot.index = (int)index;
+        snapshots.insert(snapshot.position);
+    }
+
+    void closeSnapshot(StockSnapshot& snapshot) {
+        if (!snapshot.chunk) return;
+        lock_guard<mutex> lock(versionLatch);
+        snapshots.erase(snapshots.find(snapshot.position));
+        collectVersions();
+    }
+
+    static set<int> singleValue(int value) {
+        set<int> values;
+        if (value != 0) values.insert(value);
+        return values;
+    }
+
+    // Ids of the segments of a keyword string, interning new ones
+    set<int> splitKeywords(int keyword) {
+        set<int> segments;
+        if (keyword == 0) return segments;
+        char text[61];
+        strings.read(keyword, text);
+        string_view rest(text);
+        while (!rest.empty()) {
+            size_t bar = rest.find('|');
+            string_view segment = rest.substr(0, bar);
+            if (!segment.empty()) segments.insert(strings.intern(segment));
+            if (bar == string_view::npos) break;
+            rest.remove_prefix(bar + 1);
+        }
+        return segments;
+    }
+
+    // Moves a book's postings in one index from its old state to its new
+    // one, touching only the values that changed unless the ISBN changed too
+    void reindex(BPlusTree<IndexKey, char>& index,
+                 const set<int>& oldValues, string_view oldISBN,
+                 const set<int>& newValues, string_view newISBN) {
+        bool sameISBN = oldISBN == newISBN;
+        for (int value : oldValues) {
+            if (!sameISBN || !newValues.count(value)) {
+                index.erase(IndexKey(value, oldISBN));
+            }
+        }
+        for (int value : newValues) {
+            if (!sameISBN || !oldValues.count(value)) {
+                index.insert(IndexKey(value, newISBN), 0);
+            }
+        }
+    }
+
+    void assemble(const ISBNKey& ISBN, const BookStock& bookStock,
+                  const BookInfo& bookInfo, Book& book) {
+        memcpy(book.ISBN, ISBN.data, sizeof(book.ISBN));
+        strings.read(bookInfo.name, book.name);
+        strings.read(bookInfo.author, book.author);
+        strings.read(bookInfo.keyword, book.keyword);
+        book.price = bookStock.price;
+        book.quantity = bookStock.quantity;
+    }
+
+    bool findBook(const ISBNKey& ISBN, StockSnapshot& snapshot, Book& book) {
+        BookStock bookStock;
+        BookInfo bookInfo;
+        if (!stock.find(ISBN, bookStock)) return false;
+        if (!info.find(ISBN, bookInfo)) return false;
+        assemble(ISBN, stockAt(ISBN, bookStock, snapshot), bookInfo, book);
+        return true;
+    }
+
+    // Visits the books whose postings in index carry exactly value; a value
+    // that was never interned cannot match anything
+    template <class Visitor>
+    void searchIndex(BPlusTree<IndexKey, char>& index, string_view value,
+                     StockSnapshot& snapshot, Visitor& visit) {
+        int id;
+        if (!strings.find(value, id)) return;
+        index.forEachFrom(IndexKey(id, ""), [&](const IndexKey& key, char) {
+            if (key.value != id) return false;
+            Book book;
+            if (!findBook(key.ISBN, snapshot, book)) return true;
+            return visit(book);
+        });
+    }
+
+public:
+    BookManager(Database& db, StringHeap& heap)
+        : strings(heap),
+          stock(db, "book_stock"),
+          info(db, "book_info"),
+          nameIndex(db, "book_name_index"),
+          authorIndex(db, "book_author_index"),
+          keywordIndex(db, "book_keyword_index"),
+          filter(db, "book_filter", BLOOM_FILTER_PAGES),
+          concurrent(false),
+          oldestChunk(nullptr),
+          newestChunk(nullptr),
+          applied(0) {}
+
+    ~BookManager() {
+        while (oldestChunk) {
+            VersionChunk* dead = oldestChunk;
+            oldestChunk = dead->next.load(memory_order_relaxed);
+            delete dead;
+        }
+    }
+
+    BookManager(const BookManager&) = delete;
+    BookManager& operator=(const BookManager&) = delete;
+
+    // Called before sessions start running on several threads
+    void enableConcurrency() {
+        concurrent = true;
+        oldestChunk = new VersionChunk(0);
+        newestChunk.store(oldestChunk, memory_order_release);
+    }
+
+    bool addBook(string_view ISBN) {
+        if (!stock.insert(ISBN, BookStock{0, 0})) return false;
+        info.insert(ISBN, BookInfo{0, 0, 0});
+        filter.add(ISBN);
+        return true;
+    }
+
+    const BloomFilter& getFilter() const {
+        return filter;
+    }
+
+    // Looks up the hot part of a book, letting the filter answer for ISBNs
+    // that were never added
+    bool findStock(string_view ISBN, BookStock& bookStock) {
+        if (!filter.mayContain(ISBN)) return false;
+        if (stock.find(ISBN, bookStock)) return true;
+        filter.recordFalsePositive();
+        return false;
+    }
+
+    bool exists(string_view ISBN) {
+        BookStock bookStock;
+        return findStock(ISBN, bookStock);
+    }
+
+    // Looks up only the hot part of a book
+    bool getStock(string_view ISBN, Money& price, int& quantity) {
+        BookStock bookStock;
+        if (!findStock(ISBN, bookStock)) return false;
+        price = bookStock.price;
+        quantity = bookStock.quantity;
+        return true;
+    }
+
+    bool modifyBook(string_view ISBN, string_view newISBN,
+                    string_view name, string_view author,
+                    string_view keyword, Money price) {
+        BookStock bookStock;
+        BookInfo bookInfo;
+        if (!stock.find(ISBN, bookStock) || !info.find(ISBN, bookInfo)) return false;
+        BookInfo before = bookInfo;
+
+        bool renamed = !newISBN.empty() && newISBN != ISBN;
+        string_view finalISBN = renamed ? newISBN : ISBN;
+        if (!name.empty()) bookInfo.name = strings.intern(name);
+        if (!author.empty()) bookInfo.author = strings.intern(author);
+        if (!keyword.empty()) bookInfo.keyword = strings.intern(keyword);
+        if (price >= 0) bookStock.price = price;
+
+        if (renamed) {
+            stock.erase(ISBN);
+            stock.insert(newISBN, bookStock);
+            info.erase(ISBN);
+            info.insert(newISBN, bookInfo);
+            filter.add(newISBN);
+        } else {
+            if (price >= 0) stock.update(ISBN, bookStock);
+            if (!name.empty() || !author.empty() || !keyword.empty()) info.update(ISBN, bookInfo);
+        }
+
+        reindex(nameIndex, singleValue(before.name), ISBN, singleValue(bookInfo.name), finalISBN);
+        reindex(authorIndex, singleValue(before.author), ISBN, singleValue(bookInfo.author), finalISBN);
+        reindex(keywordIndex, splitKeywords(before.keyword), ISBN,
+                splitKeywords(bookInfo.keyword), finalISBN);
+        return true;
+    }
+
+    bool importBook(string_view ISBN, int quantity) {
+        BookStock bookStock;
+        if (!stock.find(ISBN, bookStock)) return false;
+        BookStock after = bookStock;
+        after.quantity += quantity;
+        replaceStock(ISBN, bookStock, after);
+        return true;
+    }
+
+    bool buyBook(string_view ISBN, int quantity) {
+        BookStock bookStock;
+        if (!stock.find(ISBN, bookStock)) return false;
+        if (bookStock.quantity < quantity) return false;
+        BookStock after = bookStock;
+        after.quantity -= quantity;
+        replaceStock(ISBN, bookStock, after);
+        return true;
+    }
+
+    // Streams the books matching a query to visit in ISBN order, one at a
+    // time and without buffering, until the visitor returns false
+    template <class Visitor>
+    void searchBooks(BookQuery query, string_view value, Visitor visit) {
+        StockSnapshot snapshot;
+        openSnapshot(snapshot);
+        switch (query) {
+            case QUERY_ISBN: {
+                Book book;
+                if (!filter.mayContain(value)) break;
+                if (findBook(value, snapshot, book)) {
+                    visit(book);
+                } else {
+                    filter.recordFalsePositive();
+                }
+                break;
+            }
+            case QUERY_NAME:
+                searchIndex(nameIndex, value, snapshot, visit);
+                break;
+            case QUERY_AUTHOR:
+                searchIndex(authorIndex, value, snapshot, visit);
+                break;
+            case QUERY_KEYWORD:
+                searchIndex(keywordIndex, value, snapshot, visit);
+                break;
+            case QUERY_ALL: {
+                // Both trees hold the same keys, so their leaf chains zip
+                auto stockCursor = stock.begin();
+                auto infoCursor = info.begin();
+                Book book;
+                for (; stockCursor.valid() && infoCursor.valid(); stockCursor.next(), infoCursor.next()) {
+                    BookStock stored = stockCursor.value();
+                    BookStock bookStock = stockAt(stockCursor.key(), stored, snapshot);
+                    assemble(stockCursor.key(), bookStock, infoCursor.value(), book);
+                    if (!visit(book)) break;
+                }
+                break;
+            }
+        }
+        closeSnapshot(snapshot);
+    }
+};
+
+// Finance Manager
+// The finance segment is an append-only journal: a header page holding the
+// record count followed by pages of fixed-size Transactions, one per
+// completed buy or import. The finance_index segment keeps the running
+// totals after each sequence number (entry 0 is all zeros), so any suffix
+// sum is one subtraction.
+class FinanceManager {
+public:
+    // Totals over a run of transactions or over one book's transactions
+    struct Rollup {
+        Money income;
+        Money expenditure;
+        long long unitsSold;
+        long long unitsImported;
+    };
+
+    // Transactions per bucket at each rollup level
+    static const int FINE_BUCKET = 1 << 10;
+    static const int COARSE_BUCKET = 1 << 16;
+
+private:
+    static const int FINANCE_MAGIC = 0x46494e32;
+    static const int ROLLUP_MAGIC = 0x524f4c31;
+
+    struct JournalHeader {
+        int magic;
+        int count;
+    };
+
+    struct PrefixSum {
+        Money income;
+        Money expenditure;
+    };
+
+    // Number of journal transactions the rollups include
+    struct RollupHeader {
+        int magic;
+        int covered;
+    };
+
+    static const int RECORDS_PER_PAGE = PAGE_SIZE / sizeof(Transaction);
+    static const int SUMS_PER_PAGE = PAGE_SIZE / sizeof(PrefixSum);
+    static const int ROLLUPS_PER_PAGE = PAGE_SIZE / sizeof(Rollup);
+    static const int FINE_PER_COARSE = COARSE_BUCKET / FINE_BUCKET;
+
+    PageArray journal;
+    PageArray prefixSums;
+    // Rollup buckets after a header page, each coarse bucket followed by
+    // its fine buckets so that one append touches neighbouring entries
+    PageArray rollups;
+    BPlusTree<ISBNKey, Rollup> bookRollups;
+    JournalHeader journalHeader;
+    RollupHeader rollupHeader;
+    PrefixSum lastSum;
+
+    static int coarseEntry(int bucket) {
+        return bucket * (FINE_PER_COARSE + 1);
+    }
+
+    static int fineEntry(int bucket) {
+        return coarseEntry(bucket / FINE_PER_COARSE) + 1 + bucket % FINE_PER_COARSE;
+    }
+
+    static void accumulate(Rollup& rollup, const Transaction& trans) {
+        if (trans.isIncome) {
+            rollup.income += trans.amount;
+            rollup.unitsSold += trans.quantity;
+        } else {
+            rollup.expenditure += trans.amount;
+            rollup.unitsImported += trans.quantity;
+        }
+    }
+
+    Rollup readRollup(int entry) {
+        Rollup rollup;
+        PageHandle page = rollups.fetch(1 + entry / ROLLUPS_PER_PAGE);
+        memcpy(&rollup, page.data() + entry % ROLLUPS_PER_PAGE * sizeof(Rollup), sizeof(rollup));
+        return rollup;
+    }
+
+    void addToRollup(int entry, const Transaction& trans) {
+        PageHandle page = rollups.fetchOrAppend(1 + entry / ROLLUPS_PER_PAGE);
+        char* slot = page.data() + entry % ROLLUPS_PER_PAGE * sizeof(Rollup);
+        Rollup rollup;
+        memcpy(&rollup, slot, sizeof(rollup));
+        accumulate(rollup, trans);
+        memcpy(slot, &rollup, sizeof(rollup));
+        page.markDirty();
+    }
+
+    // Folds the transaction at index, which must be the next one not yet
+    // covered, into every rollup level
+    void applyRollups(int index, const Transaction& trans) {
+        addToRollup(coarseEntry(index / COARSE_BUCKET), trans);
+        addToRollup(fineEntry(index / FINE_BUCKET), trans);
+
+        ISBNKey ISBN(trans.ISBN);
+        Rollup book;
+        if (bookRollups.find(ISBN, book)) {
+            accumulate(book, trans);
+            bookRollups.update(ISBN, book);
+        } else {
+            book = Rollup{0, 0, 0, 0};
+            accumulate(book, trans);
+            bookRollups.insert(ISBN, book);
+        }
+
+        rollupHeader.covered = index + 1;
+        PageHandle page = rollups.fetch(0);
+        memcpy(page.data(), &rollupHeader, sizeof(rollupHeader));
+        page.markDirty();
+    }
+
+    Transaction readTransaction(int index) {
+        Transaction trans;
+        PageHandle page = journal.fetch(1 + index / RECORDS_PER_PAGE);
+        memcpy(&trans, page.data() + index % RECORDS_PER_PAGE * sizeof(Transaction), sizeof(trans));
+        return trans;
+    }
+
+    // Rollups missing from an older database are built from the journal
+    // the first time a report needs them, and kept current from then on
+    void catchUpRollups() {
+        while (rollupHeader.covered < journalHeader.count) {
+            applyRollups(rollupHeader.covered, readTransaction(rollupHeader.covered));
+        }
+    }
+
+    PrefixSum readPrefixSum(int sequence) {
+        PrefixSum sum;
+        PageHandle page = prefixSums.fetch(sequence / SUMS_PER_PAGE);
+        memcpy(&sum, page.data() + sequence % SUMS_PER_PAGE * sizeof(PrefixSum), sizeof(sum));
+        return sum;
+    }
+
+    void writePrefixSum(int sequence, const PrefixSum& sum) {
+        PageHandle page = prefixSums.fetchOrAppend(sequence / SUMS_PER_PAGE);
+        memcpy(page.data() + sequence % SUMS_PER_PAGE * sizeof(PrefixSum), &sum, sizeof(sum));
+        page.markDirty();
+    }
+
+    void saveHeader() {
+        PageHandle page = journal.fetch(0);
+        memcpy(page.data(), &journalHeader, sizeof(journalHeader));
+        page.markDirty();
+    }
+
+public:
+    explicit FinanceManager(Database& db)
+        : journal(db, "finance"),
+          prefixSums(db, "finance_index"),
+          rollups(db, "finance_rollup"),
+          bookRollups(db, "finance_book_rollup") {
+        {
+            PageHandle page = journal.fetchOrAppend(0);
+            memcpy(&journalHeader, page.data(), sizeof(journalHeader));
+        }
+        {
+            PageHandle page = rollups.fetchOrAppend(0);
+            memcpy(&rollupHeader, page.data(), sizeof(rollupHeader));
+            if (rollupHeader.magic != ROLLUP_MAGIC) {
+                rollupHeader = {ROLLUP_MAGIC, 0};
+                memcpy(page.data(), &rollupHeader, sizeof(rollupHeader));
+                page.markDirty();
+            }
+        }
+        if (journalHeader.magic != FINANCE_MAGIC) {
+            journalHeader.magic = FINANCE_MAGIC;
+            journalHeader.count = 0;
+            saveHeader();
+            lastSum = {0, 0};
+            writePrefixSum(0, lastSum);
+        } else {
+            lastSum = readPrefixSum(journalHeader.count);
+        }
+    }
+
+    void addTransaction(string_view userID, string_view ISBN,
+                        int quantity, Money amount, bool isIncome) {
+        Transaction trans;
+        trans.sequence = journalHeader.count + 1;
+        copyField(trans.userID, userID);
+        copyField(trans.ISBN, ISBN);
+        trans.quantity = quantity;
+        trans.amount = amount;
+        trans.isIncome = isIncome;
+
+        int index = journalHeader.count;
+        {
+            PageHandle page = journal.fetchOrAppend(1 + index / RECORDS_PER_PAGE);
+            memcpy(page.data() + index % RECORDS_PER_PAGE * sizeof(Transaction), &trans, sizeof(trans));
+            page.markDirty();
+        }
+        journalHeader.count++;
+        saveHeader();
+        if (rollupHeader.covered == index) applyRollups(index, trans);
+
+        if (isIncome) {
+            lastSum.income += amount;
+        } else {
+            lastSum.expenditure += amount;
+        }
+        writePrefixSum(journalHeader.count, lastSum);
+    }
+
+    pair<Money, Money> getFinance(int count) {
+        if (count == -1) count = journalHeader.count;
+
+        int start = max(0, journalHeader.count - count);
+        PrefixSum before = readPrefixSum(start);
+        return {lastSum.income - before.income, lastSum.expenditure - before.expenditure};
+    }
+
+    int getTransactionCount() {
+        return journalHeader.count;
+    }
+
+    // Visits the buckets of one level in order with the 1-based range of
+    // transactions each covers
+    template <class Visitor>
+    void forEachBucket(int bucketSize, Visitor visit) {
+        catchUpRollups();
+        for (int first = 0; first < journalHeader.count; first += bucketSize) {
+            int bucket = first / bucketSize;
+            int entry = bucketSize == COARSE_BUCKET ? coarseEntry(bucket) : fineEntry(bucket);
+            int last = min(journalHeader.count, first + bucketSize);
+            visit(first + 1, last, readRollup(entry));
+        }
+    }
+
+    // Moves a renamed book's totals to its new ISBN. The journal keeps the
+    // ISBN each transaction had, so rollups are caught up first.
+    void renameBook(string_view oldISBN, string_view newISBN) {
+        catchUpRollups();
+        Rollup moved;
+        if (!bookRollups.find(oldISBN, moved)) return;
+        bookRollups.erase(oldISBN);
+        Rollup merged;
+        if (bookRollups.find(newISBN, merged)) {
+            merged.income += moved.income;
+            merged.expenditure += moved.expenditure;
+            merged.unitsSold += moved.unitsSold;
+            merged.unitsImported += moved.unitsImported;
+            bookRollups.update(newISBN, merged);
+        } else {
+            bookRollups.insert(newISBN, moved);
+        }
+    }
+
+    // Visits each book that has transactions, in ISBN order
+    template <class Visitor>
+    void forEachBook(Visitor visit) {
+        catchUpRollups();
+        bookRollups.forEach([&](const ISBNKey& ISBN, const Rollup& rollup) {
+            visit(ISBN, rollup);
+            return true;
+        });
+    }
+};
+
+// Activity of one operator, counted as their employee commands succeed.
+// The last activity is the operation log event number of their latest one.
+struct EmployeeStats {
+    int selects;
+    int modifies;
+    int imports;
+    int useradds;
+    long long unitsImported;
+    Money spent;
+    long long lastActivity;
+};
+
+// Employee Manager
+// Materialized per-operator aggregates in a B+ tree keyed by userID, so
+// report employee reads one row per employee instead of the whole log
+class EmployeeManager {
+private:
+    BPlusTree<UserIDKey, EmployeeStats> table;
+
+    template <class Change>
+    void record(string_view userID, long long event, Change change) {
+        EmployeeStats stats;
+        bool known = table.find(userID, stats);
+        if (!known) memset(&stats, 0, sizeof(stats));
+        change(stats);
+        stats.lastActivity = event;
+        if (known) {
+            table.update(userID, stats);
+        } else {
+            table.insert(userID, stats);
+        }
+    }
+
+public:
+    explicit EmployeeManager(Database& db) : table(db, "employee_stats") {}
+
+    void recordSelect(string_view userID, long long event) {
+        record(userID, event, [](EmployeeStats& stats) { stats.selects++; });
+    }
+
+    void recordModify(string_view userID, long long event) {
+        record(userID, event, [](EmployeeStats& stats) { stats.modifies++; });
+    }
+
+    void recordImport(string_view userID, int quantity, Money cost, long long event) {
+        record(userID, event, [&](EmployeeStats& stats) {
+            stats.imports++;
+            stats.unitsImported += quantity;
+            stats.spent += cost;
+        });
+    }
+
+    void recordUseradd(string_view userID, long long event) {
+        record(userID, event, [](EmployeeStats& stats) { stats.useradds++; });
+    }
+
+    // Visits every employee in userID order
+    template <class Visitor>
+    void forEach(Visitor visit) {
+        table.forEach([&](const UserIDKey& userID, const EmployeeStats& stats) {
+            visit(userID, stats);
+            return true;
+        });
+    }
+};
+
+// Splits a file descriptor into lines. A regular file is mapped and
+// scanned in place; anything else is read in large blocks. Both newline
+// and carriage return end a command, so CRLF input yields an extra empty
+// line, which processCommand ignores.
+class LineReader {
+private:
+    static const size_t BLOCK_SIZE = 1 << 20;
+
+    int fd;
+    char* mapped;
+    size_t mappedSize;
+    vector<char> buffer;
+    size_t begin;
+    size_t end;
+    bool eof;
+
+    // Moves the unread tail to the front and appends the next block
+    bool refill() {
+        if (eof) return false;
+        if (begin > 0) {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == buffer.size()) buffer.resize(buffer.size() * 2);
+        ssize_t bytes = read(fd, buffer.data() + end, buffer.size() - end);
+        if (bytes <= 0) {
+            eof = true;
+            return false;
+        }
+        end += bytes;
+        return true;
+    }
+
+    static const char* findLineEnd(const char* from, const char* to) {
+        const char* newline = (const char*)memchr(from, '\n', to - from);
+        const char* limit = newline ? newline : to;
+        const char* carriage = (const char*)memchr(from, '\r', limit - from);
+        return carriage ? carriage : newline;
+    }
+
+public:
+    explicit LineReader(int input)
+        : fd(input), mapped(nullptr), mappedSize(0), begin(0), end(0), eof(false) {
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, info.st_size, MADV_SEQUENTIAL);
+                mapped = (char*)data;
+                mappedSize = info.st_size;
+                end = mappedSize;
+                eof = true;
+                return;
+            }
+        }
+        buffer.resize(BLOCK_SIZE);
+    }
+
+    ~LineReader() {
+        if (mapped) munmap(mapped, mappedSize);
+    }
+
+    LineReader(const LineReader&) = delete;
+    LineReader& operator=(const LineReader&) = delete;
+
+    // The returned view stays valid until the next call
+    bool nextLine(string_view& line) {
+        const char* data = mapped ? mapped : buffer.data();
+        size_t scanned = begin;
+        while (true) {
+            const char* lineEnd = findLineEnd(data + scanned, data + end);
+            if (lineEnd) {
+                line = string_view(data + begin, lineEnd - (data + begin));
+                begin = lineEnd - data + 1;
+                return true;
+            }
+            size_t pending = end - begin;
+            bool more = refill();
+            data = mapped ? mapped : buffer.data();
+            if (!more) break;
+            scanned = pending;
+        }
+        if (begin == end) return false;
+        line = string_view(data + begin, end - begin);
+        begin = end;
+        return true;
+    }
+};
+
+// Buffered writer for standard output. Text is formatted straight into a
+// reusable buffer, which reaches the descriptor only when it fills up or
+// is flushed.
+class OutputSink {
+private:
+    static const size_t BUFFER_SIZE = 1 << 18;
+
+    int fd;
+    vector<char> buffer;
+    size_t used;
+    // While spooling, the buffer grows instead of being written out
+    bool spooling;
+
+    void reserve(size_t length) {
+        if (used + length <= buffer.size()) return;
+        if (spooling) buffer.resize(max(2 * buffer.size(), used + length));
+        else flush();
+    }
+
+    void writeAll(const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t written = ::write(fd, data, length);
+            if (written <= 0) return;
+            data += written;
+            length -= written;
+        }
+    }
+
+public:
+    explicit OutputSink(int output) : fd(output), buffer(BUFFER_SIZE), used(0), spooling(false) {}
+
+    ~OutputSink() {
+        flush();
+    }
+
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    void write(char c) {
+        reserve(1);
+        buffer[used++] = c;
+    }
+
+    void write(string_view text) {
+        if (!spooling && text.length() > buffer.size()) {
+            flush();
+            writeAll(text.data(), text.length());
+            return;
+        }
+        reserve(text.length());
+        memcpy(buffer.data() + used, text.data(), text.length());
+        used += text.length();
+    }
+
+    // Copies a zero-terminated fixed char field without a separate strlen
+    template <size_t N>
+    void writeField(const char (&field)[N]) {
+        reserve(N);
+        char* to = buffer.data() + used;
+        size_t length = 0;
+        while (length < N && field[length]) {
+            to[length] = field[length];
+            length++;
+        }
+        used += length;
+    }
+
+    void writeInt(long long value) {
+        reserve(24);
+        char* to = buffer.data() + used;
+        if (value < 0) {
+            *to++ = '-';
+            value = -value;
         }
-        file.close();
+        char digits[20];
+        int length = 0;
+        do {
+            digits[length++] = '0' + value % 10;
+            value /= 10;
+        } while (value > 0);
+        while (length > 0) *to++ = digits[--length];
+        used = to - buffer.data();
     }
-    
-    void saveAccounts() {
-        ofstream file(ACCOUNT_FILE, ios::binary);
-        int count = accounts.size();
-        file.write((char*)&count, sizeof(count));
-        for (auto& p : accounts) {
-            file.write((char*)&p.second, sizeof(Account));
+
+    void writeMoney(Money cents) {
+        reserve(48);
+        used = formatMoney(cents, buffer.data() + used) - buffer.data();
+    }
+
+    // Holds a whole reply in memory, so a client that stops reading cannot
+    // stall the writer while it holds a lock
+    void setSpooling(bool enabled) {
+        spooling = enabled;
+    }
+
+    void flush() {
+        writeAll(buffer.data(), used);
+        used = 0;
+        if (buffer.size() > BUFFER_SIZE) {
+            buffer.resize(BUFFER_SIZE);
+            buffer.shrink_to_fit();
         }
-        file.close();
     }
-    
+};
+
+// Command tokens: views into the input line, which must outlive them
+class ArgList {
+private:
+    const string_view* first;
+    const string_view* last;
+
 public:
-    AccountManager() {
-        loadAccounts();
-        if (accounts.find("root") == accounts.end()) {
-            Account root;
-            strcpy(root.userID, "root");
-            strcpy(root.password, "sjtu");
-            strcpy(root.username, "root");
-            root.privilege = 7;
-            accounts["root"] = root;
-            saveAccounts();
-        }
+    ArgList(const string_view* begin, const string_view* end) : first(begin), last(end) {}
+
+    size_t size() const {
+        return last - first;
     }
-    
-    bool addAccount(const string& userID, const string& password, 
-                   int privilege, const string& username) {
-        if (accounts.find(userID) != accounts.end()) return false;
-        
-        Account acc;
-        strcpy(acc.userID, userID.c_str());
-        strcpy(acc.password, password.c_str());
-        strcpy(acc.username, username.c_str());
-        acc.privilege = privilege;
-        accounts[userID] = acc;
-        saveAccounts();
-        return true;
+
+    bool empty() const {
+        return first == last;
     }
-    
-    bool deleteAccount(const string& userID) {
-        if (accounts.find(userID) == accounts.end()) return false;
-        accounts.erase(userID);
-        saveAccounts();
-        return true;
+
+    string_view operator[](size_t i) const {
+        return first[i];
     }
-    
-    bool checkPassword(const string& userID, const string& password) {
-        if (accounts.find(userID) == accounts.end()) return false;
-        return accounts[userID].password == password;
+
+    const string_view* begin() const {
+        return first;
     }
-    
-    bool changePassword(const string& userID, const string& newPassword) {
-        if (accounts.find(userID) == accounts.end()) return false;
-        strcpy(accounts[userID].password, newPassword.c_str());
-        saveAccounts();
-        return true;
+
+    const string_view* end() const {
+        return last;
     }
-    
-    int getPrivilege(const string& userID) {
-        if (accounts.find(userID) == accounts.end()) return -1;
-        return accounts[userID].privilege;
+
+    // The arguments after the first one
+    ArgList tail() const {
+        return ArgList(first + 1, last);
     }
-    
-    bool exists(const string& userID) {
-        return accounts.find(userID) != accounts.end();
+};
+
+enum CommandCode {
+    CMD_UNKNOWN, CMD_QUIT, CMD_SU, CMD_LOGOUT, CMD_REGISTER, CMD_PASSWD, CMD_USERADD,
+    CMD_DELETE, CMD_SHOW, CMD_BUY, CMD_SELECT, CMD_MODIFY, CMD_IMPORT, CMD_LOG, CMD_REPORT
+};
+
+// Switches on the length of the command word first, so at most a few
+// candidates are compared
+CommandCode lookupCommand(string_view word) {
+    switch (word.length()) {
+        case 2:
+            if (word == "su") return CMD_SU;
+            break;
+        case 3:
+            if (word == "buy") return CMD_BUY;
+            if (word == "log") return CMD_LOG;
+            break;
+        case 4:
+            if (word == "show") return CMD_SHOW;
+            if (word == "quit" || word == "exit") return CMD_QUIT;
+            break;
+        case 6:
+            if (word == "select") return CMD_SELECT;
+            if (word == "modify") return CMD_MODIFY;
+            if (word == "import") return CMD_IMPORT;
+            if (word == "logout") return CMD_LOGOUT;
+            if (word == "passwd") return CMD_PASSWD;
+            if (word == "delete") return CMD_DELETE;
+            if (word == "report") return CMD_REPORT;
+            break;
+        case 7:
+            if (word == "useradd") return CMD_USERADD;
+            break;
+        case 8:
+            if (word == "register") return CMD_REGISTER;
+            break;
     }
+    return CMD_UNKNOWN;
+}
+
+const char* commandName(CommandCode code) {
+    static const char* const names[] = {
+        "unknown", "quit", "su", "logout", "register", "passwd", "useradd",
+        "delete", "show", "buy", "select", "modify", "import", "log", "report"
+    };
+    return names[code];
+}
+
+// One command in the audit trail. The target is the ISBN or userID the
+// command names; fields that do not apply stay zero.
+struct LogEvent {
+    char operatorID[31];
+    char command;
+    char success;
+    char target[31];
+    int quantity;
+    Money amount;
 };
 
-// Book Manager
-class BookManager {
+// Audit trail of every command in log.dat. The command thread copies
+// fixed-size events into a single-producer ring buffer without locking; a
+// writer thread drains it and encodes the events into blocks. Each block
+// starts with a header giving its first sequence number, event count and
+// length, then a dictionary of the userIDs and ISBNs it mentions, then one
+// record per event: varint sequence delta, command byte, dictionary
+// references and zigzag varint quantity and amount. A block decodes on its
+// own, and the headers alone index the file. Blocks are sealed when full,
+// when the log is read, on shutdown, and each time the database flushes
+// its pages, just after them; events not yet sealed are lost in a crash.
+class OperationLog {
 private:
-    map<string, Book> books;
-    
-    void loadBooks() {
-        ifstream file(BOOK_FILE, ios::binary);
-        if (!file) return;
-        
-        int count;
-        file.read((char*)&count, sizeof(count));
-        for (int i = 0; i < count; i++) {
-            Book book;
-            file.read((char*)&book, sizeof(book));
-            books[book.ISBN] = book;
+    static const int LOG_MAGIC = 0x424c4f47;
+    static const int LOG_VERSION = 3;
+    static const int BLOCK_MAGIC = 0x424c4b31;
+    // A power of two, so positions can grow without wrapping
+    static const size_t RING_SIZE = 1 << 12;
+    static const int BLOCK_EVENTS = 1 << 12;
+
+    struct LogHeader {
+        int magic;
+        int version;
+    };
+
+    struct BlockHeader {
+        int magic;
+        int payloadSize;
+        int eventCount;
+        int dictionarySize;
+        long long firstSequence;
+        unsigned int checksum;
+    };
+
+    struct BlockIndexEntry {
+        long long firstSequence;
+        int eventCount;
+        off_t offset;
+    };
+
+    string fileName;
+    int fd;
+    // Events already in the file when it was opened
+    long long baseCount;
+    vector<LogEvent> ring;
+    // Positions only grow; the producer owns head and the writer owns tail
+    atomic<size_t> head;
+    atomic<size_t> tail;
+    // Positions whose events are in sealed blocks
+    atomic<size_t> persisted;
+    atomic<bool> syncRequested;
+    atomic<bool> stopping;
+    mutex wakeMutex;
+    condition_variable wake;
+    mutex indexMutex;
+    vector<BlockIndexEntry> blockIndex;
+
+    // Block being encoded, owned by the writer thread
+    unordered_map<string, int> dictionary;
+    vector<char> dictionaryBytes;
+    vector<char> eventBytes;
+    vector<char> blockBuffer;
+    int pendingEvents;
+    long long pendingFirst;
+    long long lastSequence;
+    off_t fileEnd;
+
+    thread writer;
+
+    template <typename Unsigned>
+    static void putVarint(vector<char>& bytes, Unsigned value) {
+        while (value >= 0x80) {
+            bytes.push_back((char)(value | 0x80));
+            value >>= 7;
         }
-        file.close();
+        bytes.push_back((char)value);
     }
-    
-    void saveBooks() {
-        ofstream file(BOOK_FILE, ios::binary);
-        int count = books.size();
-        file.write((char*)&count, sizeof(count));
-        for (auto& p : books) {
-            file.write((char*)&p.second, sizeof(Book));
+
+    template <typename Unsigned>
+    static bool getVarint(const char*& from, const char* end, Unsigned& value) {
+        value = 0;
+        for (int shift = 0; from < end && shift < 8 * (int)sizeof(Unsigned); shift += 7) {
+            unsigned char byte = *from++;
+            value |= (Unsigned)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
         }
-        file.close();
+        return false;
     }
 
-public:
-    BookManager() {
-        loadBooks();
+    static unsigned long long zigzag(long long value) {
+        return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
     }
 
-    bool addBook(const string& ISBN) {
-        if (books.find(ISBN) != books.end()) return false;
-        Book book;
-        strcpy(book.ISBN, ISBN.c_str());
-        books[ISBN] = book;
-        saveBooks();
-        return true;
+    static long long unzigzag(unsigned long long value) {
+        return (long long)(value >> 1) ^ -(long long)(value & 1);
     }
 
-    bool exists(const string& ISBN) {
-        return books.find(ISBN) != books.end();
+    static unsigned __int128 zigzag(Money value) {
+        return ((unsigned __int128)value << 1) ^ (unsigned __int128)(value >> 127);
     }
 
-    Book* getBook(const string& ISBN) {
-        if (books.find(ISBN) == books.end()) return nullptr;
-        return &books[ISBN];
+    static Money unzigzag(unsigned __int128 value) {
+        return (Money)(value >> 1) ^ -(Money)(value & 1);
     }
 
-    void modifyBook(const string& ISBN, const string& newISBN,
-                   const string& name, const string& author,
-                   const string& keyword, double price) {
-        if (books.find(ISBN) == books.end()) return;
+    void writeAll(const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t written = ::write(fd, data, length);
+            if (written <= 0) return;
+            data += written;
+            length -= written;
+        }
+    }
 
-        Book book = books[ISBN];
-        if (!newISBN.empty() && newISBN != ISBN) {
-            books.erase(ISBN);
-            strcpy(book.ISBN, newISBN.c_str());
+    // Reads a block and checks it against its checksum
+    bool readBlock(off_t offset, BlockHeader& header, vector<char>& payload) {
+        if (pread(fd, &header, sizeof(header), offset) != (ssize_t)sizeof(header) ||
+            header.magic != BLOCK_MAGIC || header.payloadSize < 0) {
+            return false;
         }
-        if (!name.empty()) strcpy(book.name, name.c_str());
-        if (!author.empty()) strcpy(book.author, author.c_str());
-        if (!keyword.empty()) strcpy(book.keyword, keyword.c_str());
-        if (price >= 0) book.price = price;
+        payload.resize(header.payloadSize);
+        return pread(fd, payload.data(), payload.size(), offset + sizeof(header)) ==
+                   (ssize_t)payload.size() &&
+               fnv1a(payload.data(), payload.size()) == header.checksum;
+    }
 
-        books[book.ISBN] = book;
-        saveBooks();
+    // Indexes the blocks by walking their headers, starting a new log when
+    // the file is missing or of another format. Only the last block can be
+    // torn by a crash, so it alone is verified and cut off if incomplete.
+    void open() {
+        fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) throw runtime_error("cannot open " + fileName);
+        LogHeader header = {LOG_MAGIC, LOG_VERSION};
+        LogHeader existing;
+        struct stat info;
+        fstat(fd, &info);
+        off_t offset = sizeof(header);
+        if (pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) &&
+            existing.magic == header.magic && existing.version == header.version) {
+            BlockHeader block;
+            while (pread(fd, &block, sizeof(block), offset) == (ssize_t)sizeof(block) &&
+                   block.magic == BLOCK_MAGIC && block.payloadSize >= 0 &&
+                   offset + (off_t)sizeof(block) + block.payloadSize <= info.st_size) {
+                blockIndex.push_back({block.firstSequence, block.eventCount, offset});
+                offset += sizeof(block) + block.payloadSize;
+            }
+            vector<char> payload;
+            if (!blockIndex.empty() && !readBlock(blockIndex.back().offset, block, payload)) {
+                offset = blockIndex.back().offset;
+                blockIndex.pop_back();
+            }
+            if (ftruncate(fd, offset) != 0) throw runtime_error("cannot truncate " + fileName);
+        } else {
+            if (ftruncate(fd, 0) != 0) throw runtime_error("cannot truncate " + fileName);
+            writeAll((const char*)&header, sizeof(header));
+        }
+        if (!blockIndex.empty()) {
+            baseCount = blockIndex.back().firstSequence + blockIndex.back().eventCount - 1;
+        }
+        fileEnd = lseek(fd, 0, SEEK_END);
     }
 
-    void importBook(const string& ISBN, int quantity) {
-        if (books.find(ISBN) == books.end()) return;
-        books[ISBN].quantity += quantity;
-        saveBooks();
+    int reference(const char* field) {
+        if (!field[0]) return 0;
+        auto [entry, added] = dictionary.emplace(field, (int)dictionary.size() + 1);
+        if (added) {
+            size_t length = strlen(field);
+            putVarint(dictionaryBytes, length);
+            dictionaryBytes.insert(dictionaryBytes.end(), field, field + length);
+        }
+        return entry->second;
     }
 
-    bool buyBook(const string& ISBN, int quantity) {
-        if (books.find(ISBN) == books.end()) return false;
-        if (books[ISBN].quantity < quantity) return false;
-        books[ISBN].quantity -= quantity;
-        saveBooks();
-        return true;
+    void encode(const LogEvent& event, long long sequence) {
+        if (pendingEvents == 0) pendingFirst = lastSequence = sequence;
+        putVarint(eventBytes, sequence - lastSequence);
+        lastSequence = sequence;
+        eventBytes.push_back((char)(event.command | (event.success ? 0x80 : 0)));
+        putVarint(eventBytes, reference(event.operatorID));
+        putVarint(eventBytes, reference(event.target));
+        putVarint(eventBytes, zigzag((long long)event.quantity));
+        putVarint(eventBytes, zigzag(event.amount));
+        pendingEvents++;
     }
 
-    vector<Book> searchBooks(const string& type, const string& value) {
-        vector<Book> result;
-
-        for (auto& p : books) {
-            bool match = false;
-            if (type.empty()) {
-                match = true;
-            } else if (type == "ISBN") {
-                match = (p.second.ISBN == value);
-            } else if (type == "name") {
-                match = (p.second.name == value);
-            } else if (type == "author") {
-                match = (p.second.author == value);
-            } else if (type == "keyword") {
-                string keywords = p.second.keyword;
-                vector<string> parts;
-                string part;
-                for (char c : keywords) {
-                    if (c == '|') {
-                        parts.push_back(part);
-                        part.clear();
-                    } else {
-                        part += c;
-                    }
-                }
-                if (!part.empty()) parts.push_back(part);
+    void sealBlock() {
+        BlockHeader header;
+        header.magic = BLOCK_MAGIC;
+        header.payloadSize = dictionaryBytes.size() + eventBytes.size();
+        header.eventCount = pendingEvents;
+        header.dictionarySize = dictionary.size();
+        header.firstSequence = pendingFirst;
+        blockBuffer.resize(sizeof(header));
+        blockBuffer.insert(blockBuffer.end(), dictionaryBytes.begin(), dictionaryBytes.end());
+        blockBuffer.insert(blockBuffer.end(), eventBytes.begin(), eventBytes.end());
+        header.checksum = fnv1a(blockBuffer.data() + sizeof(header), header.payloadSize);
+        memcpy(blockBuffer.data(), &header, sizeof(header));
+        writeAll(blockBuffer.data(), blockBuffer.size());
+        {
+            lock_guard<mutex> lock(indexMutex);
+            blockIndex.push_back({pendingFirst, pendingEvents, fileEnd});
+        }
+        fileEnd += blockBuffer.size();
+
+        persisted.fetch_add(pendingEvents, memory_order_release);
+        dictionary.clear();
+        dictionaryBytes.clear();
+        eventBytes.clear();
+        pendingEvents = 0;
+    }
 
-                for (const string& kw : parts) {
-                    if (kw == value) {
-                        match = true;
-                        break;
-                    }
+    void drain() {
+        while (true) {
+            size_t from = tail.load(memory_order_relaxed);
+            size_t to = head.load(memory_order_acquire);
+            if (from != to) {
+                for (size_t position = from; position < to; position++) {
+                    encode(ring[position % RING_SIZE], baseCount + position + 1);
+                    if (pendingEvents == BLOCK_EVENTS) sealBlock();
                 }
+                tail.store(to, memory_order_release);
+                continue;
             }
+            if (pendingEvents > 0 &&
+                (syncRequested.load(memory_order_acquire) || stopping.load(memory_order_acquire))) {
+                sealBlock();
+                continue;
+            }
+            if (stopping.load(memory_order_acquire)) {
+                if (head.load(memory_order_acquire) == from) return;
+                continue;
+            }
+            // Wake-ups are only hints, so a missed one costs one timeout
+            unique_lock<mutex> lock(wakeMutex);
+            wake.wait_for(lock, chrono::milliseconds(10));
+        }
+    }
 
-            if (match) result.push_back(p.second);
+    // Decodes one block, calling visit for its events from sequence first on
+    template <class Visitor>
+    bool decodeBlock(off_t offset, long long first, vector<char>& payload, Visitor& visit) {
+        BlockHeader header;
+        if (!readBlock(offset, header, payload)) return false;
+        const char* from = payload.data();
+        const char* end = from + payload.size();
+        unsigned long long value;
+
+        vector<string_view> strings(1);
+        for (int i = 0; i < header.dictionarySize; i++) {
+            if (!getVarint(from, end, value) || value > (unsigned long long)(end - from)) return false;
+            strings.emplace_back(from, value);
+            from += value;
         }
 
-        sort(result.begin(), result.end(), [](const Book& a, const Book& b) {
-            return strcmp(a.ISBN, b.ISBN) < 0;
-        });
+        long long sequence = header.firstSequence;
+        for (int i = 0; i < header.eventCount; i++) {
+            LogEvent event;
+            memset(&event, 0, sizeof(event));
+            unsigned long long delta, operatorRef, targetRef, quantity;
+            unsigned __int128 amount;
+            if (!getVarint(from, end, delta) || from == end) return false;
+            unsigned char command = *from++;
+            if (!getVarint(from, end, operatorRef) || !getVarint(from, end, targetRef) ||
+                !getVarint(from, end, quantity) || !getVarint(from, end, amount) ||
+                operatorRef >= strings.size() || targetRef >= strings.size()) {
+                return false;
+            }
+            sequence += delta;
+            event.command = command & 0x7f;
+            event.success = (command & 0x80) != 0;
+            copyField(event.operatorID, strings[operatorRef]);
+            copyField(event.target, strings[targetRef]);
+            event.quantity = unzigzag(quantity);
+            event.amount = unzigzag(amount);
+            if (sequence >= first) visit(sequence, event);
+        }
+        return true;
+    }
 
-        return result;
+public:
+    explicit OperationLog(const string& name)
+        : fileName(name), fd(-1), baseCount(0), ring(RING_SIZE), head(0), tail(0), persisted(0),
+          syncRequested(false), stopping(false), pendingEvents(0), pendingFirst(0),
+          lastSequence(0), fileEnd(0) {
+        open();
+        writer = thread(&OperationLog::drain, this);
     }
-};
 
-// Finance Manager
-class FinanceManager {
-private:
-    vector<Transaction> transactions;
+    ~OperationLog() {
+        stopping.store(true, memory_order_release);
+        wake.notify_one();
+        writer.join();
+        close(fd);
+    }
 
-    void loadTransactions() {
-        ifstream file(FINANCE_FILE, ios::binary);
-        if (!file) return;
+    OperationLog(const OperationLog&) = delete;
+    OperationLog& operator=(const OperationLog&) = delete;
 
-        int count;
-        file.read((char*)&count, sizeof(count));
-        for (int i = 0; i < count; i++) {
-            Transaction trans;
-            file.read((char*)&trans, sizeof(trans));
-            transactions.push_back(trans);
+    // Waits for room only when the writer has fallen a full ring behind.
+    // Returns the event's number, counting from 1.
+    long long append(const LogEvent& event) {
+        size_t position = head.load(memory_order_relaxed);
+        while (position - tail.load(memory_order_acquire) == RING_SIZE) {
+            wake.notify_one();
+            this_thread::yield();
         }
-        file.close();
+        ring[position % RING_SIZE] = event;
+        head.store(position + 1, memory_order_release);
+        if ((position + 1) % (RING_SIZE / 2) == 0) wake.notify_one();
+        return baseCount + position + 1;
     }
 
-    void saveTransactions() {
-        ofstream file(FINANCE_FILE, ios::binary);
-        int count = transactions.size();
-        file.write((char*)&count, sizeof(count));
-        for (auto& trans : transactions) {
-            file.write((char*)&trans, sizeof(trans));
+    // Returns once every appended event is in a sealed block
+    void sync() {
+        syncRequested.store(true, memory_order_release);
+        while (persisted.load(memory_order_acquire) != head.load(memory_order_relaxed)) {
+            wake.notify_one();
+            this_thread::yield();
         }
-        file.close();
+        syncRequested.store(false, memory_order_release);
     }
 
-public:
-    FinanceManager() {
-        loadTransactions();
+    // Visits events in order from sequence number first on, decoding only
+    // the blocks that hold them
+    template <class Visitor>
+    void forEachSince(long long first, Visitor visit) {
+        sync();
+        lock_guard<mutex> lock(indexMutex);
+        auto block = upper_bound(blockIndex.begin(), blockIndex.end(), first,
+                                 [](long long sequence, const BlockIndexEntry& entry) {
+                                     return sequence < entry.firstSequence;
+                                 });
+        if (block != blockIndex.begin()) --block;
+        vector<char> payload;
+        for (; block != blockIndex.end(); ++block) {
+            if (!decodeBlock(block->offset, first, payload, visit)) break;
+        }
     }
 
-    void addTransaction(double amount, bool isIncome) {
-        Transaction trans;
-        trans.amount = amount;
-        trans.isIncome = isIncome;
-        transactions.push_back(trans);
-        saveTransactions();
+    template <class Visitor>
+    void forEach(Visitor visit) {
+        forEachSince(1, visit);
     }
+};
 
-    pair<double, double> getFinance(int count) {
-        double income = 0, expenditure = 0;
+class BookstoreSystem;
+
+// Storage shared by every session: the database with its managers, the
+// operation log, which accounts are logged in anywhere, and group commit.
+// Sessions running on several threads hold commandLock shared for show,
+// buy and import, and exclusively for everything else. Book searches read
+// a snapshot, so buy and import only need to be serialized among
+// themselves and with show finance, which reads what they append.
+class BookstoreEngine {
+public:
+    BufferPool bufferPool;
+    Database database;
+    StringHeap strings;
+    AccountManager accountMgr;
+    BookManager bookMgr;
+    FinanceManager financeMgr;
+    EmployeeManager employeeMgr;
+    OperationLog operationLog;
 
-        if (count == -1) count = transactions.size();
+    // Number of login frames per account slot across all sessions
+    unordered_map<int, int> loginCounts;
+    // Every open session, so a rename reaches the selections of all of them
+    set<BookstoreSystem*> sessions;
 
-        int start = max(0, (int)transactions.size() - count);
-        for (int i = start; i < transactions.size(); i++) {
-            if (transactions[i].isIncome) {
-                income += transactions[i].amount;
-            } else {
-                expenditure += transactions[i].amount;
+    shared_mutex commandLock;
+    mutex updateMutex;
+    // The operation log takes one producer at a time, and read-only
+    // commands log concurrently
+    mutex logMutex;
+
+private:
+    int commandsSinceFlush;
+    chrono::steady_clock::time_point lastFlush;
+
+    // Flushes an idle database on time, between commands
+    thread flusher;
+    mutex flusherMutex;
+    condition_variable flusherWake;
+    bool stopping;
+
+    void flushWhenIdle() {
+        unique_lock<mutex> wait(flusherMutex);
+        while (!flusherWake.wait_for(wait, chrono::milliseconds(FLUSH_INTERVAL_MS),
+                                     [&] { return stopping; })) {
+            unique_lock<shared_mutex> lock(commandLock);
+            if (bufferPool.hasDirtyPages() &&
+                chrono::steady_clock::now() - lastFlush >= chrono::milliseconds(FLUSH_INTERVAL_MS)) {
+                flush();
             }
         }
+    }
+
+    void stopFlusher() {
+        if (!flusher.joinable()) return;
+        {
+            lock_guard<mutex> lock(flusherMutex);
+            stopping = true;
+        }
+        flusherWake.notify_one();
+        flusher.join();
+    }
 
-        return {income, expenditure};
+public:
+    explicit BookstoreEngine(int poolPages)
+        : bufferPool(poolPages),
+          database(bufferPool, DATABASE_FILE, REDO_LOG_FILE),
+          strings(database),
+          accountMgr(database, strings),
+          bookMgr(database, strings),
+          financeMgr(database),
+          employeeMgr(database),
+          operationLog(LOG_FILE),
+          commandsSinceFlush(0),
+          lastFlush(chrono::steady_clock::now()),
+          stopping(false) {
+        flusher = thread(&BookstoreEngine::flushWhenIdle, this);
     }
 
-    int getTransactionCount() {
-        return transactions.size();
+    ~BookstoreEngine() {
+        stopFlusher();
+    }
+
+    BookstoreEngine(const BookstoreEngine&) = delete;
+    BookstoreEngine& operator=(const BookstoreEngine&) = delete;
+
+    // Called before sessions start running on several threads
+    void enableConcurrency() {
+        bufferPool.enableConcurrency();
+        bookMgr.enableConcurrency();
+    }
+
+    // Called between commands only. The operation log is sealed after the
+    // pages, so it does not get ahead of the database it describes.
+    void flush() {
+        bufferPool.flush();
+        operationLog.sync();
+        commandsSinceFlush = 0;
+        lastFlush = chrono::steady_clock::now();
+    }
+
+    // Group commit: dirty pages are written back once enough commands or
+    // enough time have gone by since the last flush, or once the pool has
+    // had to grow to hold them
+    void maybeFlush() {
+        commandsSinceFlush++;
+        if (!bufferPool.hasDirtyPages()) return;
+        if (commandsSinceFlush >= FLUSH_INTERVAL_COMMANDS || bufferPool.overCapacity() ||
+            chrono::steady_clock::now() - lastFlush >= chrono::milliseconds(FLUSH_INTERVAL_MS)) {
+            flush();
+        }
+    }
+
+    // Makes every change durable once the last session has ended
+    void shutdown() {
+        stopFlusher();
+        flush();
+        if (getenv("BOOKSTORE_STATS")) {
+            accountMgr.getFilter().reportStats("account filter");
+            bookMgr.getFilter().reportStats("book filter");
+        }
     }
 };
 
 // Main System
+// One session of commands: its own input, output and login stack, working
+// on the engine's shared storage
 class BookstoreSystem {
 private:
-    AccountManager accountMgr;
-    BookManager bookMgr;
-    FinanceManager financeMgr;
-
-    vector<string> loginStack;
-    map<string, string> selectedBooks;
-    set<string> loggedInUsers;
-
-    int getCurrentPrivilege() {
+    static const size_t MAX_TOKENS = 16;
+
+    BookstoreEngine& engine;
+    int inputFd;
+    OutputSink out;
+    AccountManager& accountMgr;
+    BookManager& bookMgr;
+    FinanceManager& financeMgr;
+    EmployeeManager& employeeMgr;
+    OperationLog& operationLog;
+    unordered_map<int, int>& loginCounts;
+    // The command being processed, logged once its handler returns
+    LogEvent event;
+
+    // One login on the stack. The account is copied in at su time, which is
+    // safe because privileges never change and a logged-in account cannot be
+    // deleted. Each login has its own selection, kept as the book's key.
+    struct SessionFrame {
+        AccountRecord record;
+        bool hasSelection;
+        ISBNKey selected;
+    };
+
+    vector<SessionFrame> loginStack;
+
+    bool running;
+
+    int getCurrentPrivilege() const {
         if (loginStack.empty()) return 0;
-        return accountMgr.getPrivilege(loginStack.back());
+        return loginStack.back().record.account.privilege;
     }
 
-    string getCurrentUser() {
-        if (loginStack.empty()) return "";
-        return loginStack.back();
+    string_view getCurrentUser() const {
+        if (loginStack.empty()) return string_view();
+        return loginStack.back().record.account.userID;
     }
 
-    string trim(const string& s) {
-        size_t start = 0, end = s.length();
-        while (start < end && s[start] == ' ') start++;
-        while (end > start && s[end-1] == ' ') end--;
-        return s.substr(start, end - start);
+    // Rejects the current command
+    void invalid() {
+        out.write("Invalid\n");
+        event.success = false;
     }
 
-    vector<string> split(const string& s) {
-        vector<string> result;
-        string word;
-        for (char c : s) {
-            if (c == ' ') {
-                if (!word.empty()) {
-                    result.push_back(word);
-                    word.clear();
-                }
-            } else {
-                word += c;
-            }
+    void setTarget(string_view target) {
+        copyField(event.target, target);
+    }
+
+    // Points every login that selected a renamed book at its new ISBN
+    void followRename(const ISBNKey& oldKey, string_view newISBN) {
+        for (SessionFrame& frame : loginStack) {
+            if (frame.hasSelection && frame.selected == oldKey) frame.selected = newISBN;
         }
-        if (!word.empty()) result.push_back(word);
-        return result;
     }
 
-    void cmdSu(const vector<string>& args) {
+    // The current login's frame if it has selected a book
+    SessionFrame* selectedFrame() {
+        if (loginStack.empty() || !loginStack.back().hasSelection) return nullptr;
+        return &loginStack.back();
+    }
+
+    void cmdSu(ArgList args) {
         if (args.size() < 1 || args.size() > 2) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string userID = args[0];
-        string password = args.size() == 2 ? args[1] : "";
+        string_view userID = args[0];
+        string_view password = args.size() == 2 ? args[1] : string_view();
+        setTarget(userID);
 
         if (!isValidUserID(userID) || (!password.empty() && !isValidPassword(password))) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        if (!accountMgr.exists(userID)) {
-            cout << "Invalid\n";
+        AccountRecord target;
+        if (!accountMgr.find(userID, target)) {
+            invalid();
             return;
         }
 
-        int targetPrivilege = accountMgr.getPrivilege(userID);
-        int currentPrivilege = getCurrentPrivilege();
-
         if (password.empty()) {
-            if (currentPrivilege <= targetPrivilege) {
-                cout << "Invalid\n";
+            if (getCurrentPrivilege() <= target.account.privilege) {
+                invalid();
                 return;
             }
         } else {
-            if (!accountMgr.checkPassword(userID, password)) {
-                cout << "Invalid\n";
+            if (password != target.account.password) {
+                invalid();
                 return;
             }
         }
 
-        loginStack.push_back(userID);
-        loggedInUsers.insert(userID);
+        loginStack.push_back(SessionFrame{target, false, ISBNKey()});
+        loginCounts[target.slot]++;
     }
 
     void cmdLogout() {
         if (loginStack.empty()) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string user = loginStack.back();
+        setTarget(getCurrentUser());
+        auto count = loginCounts.find(loginStack.back().record.slot);
+        if (--count->second == 0) loginCounts.erase(count);
         loginStack.pop_back();
-        selectedBooks.erase(user);
-
-        // Check if user is still logged in
-        bool stillLoggedIn = false;
-        for (const string& u : loginStack) {
-            if (u == user) {
-                stillLoggedIn = true;
-                break;
-            }
-        }
-        if (!stillLoggedIn) {
-            loggedInUsers.erase(user);
-        }
     }
 
-    void cmdRegister(const vector<string>& args) {
+    void cmdRegister(ArgList args) {
         if (args.size() != 3) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string userID = args[0];
-        string password = args[1];
-        string username = args[2];
+        string_view userID = args[0];
+        string_view password = args[1];
+        string_view username = args[2];
+        setTarget(userID);
 
         if (!isValidUserID(userID) || !isValidPassword(password) || !isValidUsername(username)) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
         if (!accountMgr.addAccount(userID, password, 1, username)) {
-            cout << "Invalid\n";
+            invalid();
         }
     }
 
-    void cmdPasswd(const vector<string>& args) {
+    void cmdPasswd(ArgList args) {
         if (getCurrentPrivilege() < 1) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
         if (args.size() < 2 || args.size() > 3) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string userID = args[0];
-        string currentPassword = args.size() == 3 ? args[1] : "";
-        string newPassword = args.size() == 3 ? args[2] : args[1];
+        string_view userID = args[0];
+        string_view currentPassword = args.size() == 3 ? args[1] : string_view();
+        string_view newPassword = args.size() == 3 ? args[2] : args[1];
+        setTarget(userID);
 
         if (!isValidUserID(userID) || (!currentPassword.empty() && !isValidPassword(currentPassword))
             || !isValidPassword(newPassword)) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        if (!accountMgr.exists(userID)) {
-            cout << "Invalid\n";
+        AccountRecord record;
+        if (!accountMgr.find(userID, record)) {
+            invalid();
             return;
         }
 
         if (currentPassword.empty()) {
             if (getCurrentPrivilege() != 7) {
-                cout << "Invalid\n";
+                invalid();
                 return;
             }
         } else {
-            if (!accountMgr.checkPassword(userID, currentPassword)) {
-                cout << "Invalid\n";
+            if (currentPassword != record.account.password) {
+                invalid();
                 return;
             }
         }
 
-        accountMgr.changePassword(userID, newPassword);
+        accountMgr.changePassword(record, newPassword);
     }
 
-    void cmdUseradd(const vector<string>& args) {
+    void cmdUseradd(ArgList args) {
         if (getCurrentPrivilege() < 3) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
         if (args.size() != 4) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string userID = args[0];
-        string password = args[1];
-        string privilegeStr = args[2];
-        string username = args[3];
+        string_view userID = args[0];
+        string_view password = args[1];
+        string_view privilegeStr = args[2];
+        string_view username = args[3];
+        setTarget(userID);
 
         if (!isValidUserID(userID) || !isValidPassword(password) ||
             privilegeStr.length() != 1 || !isdigit(privilegeStr[0]) ||
             !isValidUsername(username)) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
         int privilege = privilegeStr[0] - '0';
         if (privilege != 1 && privilege != 3 && privilege != 7) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
         if (privilege >= getCurrentPrivilege()) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
         if (!accountMgr.addAccount(userID, password, privilege, username)) {
-            cout << "Invalid\n";
+            invalid();
+            return;
         }
     }
 
-    void cmdDelete(const vector<string>& args) {
+    void cmdDelete(ArgList args) {
         if (getCurrentPrivilege() < 7) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
         if (args.size() != 1) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string userID = args[0];
+        string_view userID = args[0];
+        setTarget(userID);
 
         if (!isValidUserID(userID)) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        if (!accountMgr.exists(userID)) {
-            cout << "Invalid\n";
+        AccountRecord record;
+        if (!accountMgr.find(userID, record)) {
+            invalid();
             return;
         }
 
-        if (loggedInUsers.find(userID) != loggedInUsers.end()) {
-            cout << "Invalid\n";
+        if (loginCounts.count(record.slot)) {
+            invalid();
             return;
         }
 
-        accountMgr.deleteAccount(userID);
+        accountMgr.deleteAccount(record);
     }
 
-    void cmdShow(const vector<string>& args) {
+    void cmdShow(ArgList args) {
         if (getCurrentPrivilege() < 1) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string type, value;
+        BookQuery query = QUERY_ALL;
+        string_view value;
 
-        if (args.empty()) {
-            type = "";
-            value = "";
-        } else if (args.size() == 1) {
-            string arg = args[0];
-            if (arg.substr(0, 6) == "-ISBN=") {
-                type = "ISBN";
+        if (args.size() == 1) {
+            string_view arg = args[0];
+            if (startsWith(arg, "-ISBN=")) {
+                query = QUERY_ISBN;
                 value = arg.substr(6);
                 if (value.empty() || !isValidISBN(value)) {
-                    cout << "Invalid\n";
-                    return;
-                }
-            } else if (arg.substr(0, 6) == "-name=") {
-                if (arg.length() < 9 || arg[6] != '"' || arg.back() != '"') {
-                    cout << "Invalid\n";
-                    return;
-                }
-                type = "name";
-                value = arg.substr(7, arg.length() - 8);
-                if (value.empty() || !isValidBookName(value)) {
-                    cout << "Invalid\n";
-                    return;
-                }
-            } else if (arg.substr(0, 8) == "-author=") {
-                if (arg.length() < 11 || arg[8] != '"' || arg.back() != '"') {
-                    cout << "Invalid\n";
+                    invalid();
                     return;
                 }
-                type = "author";
-                value = arg.substr(9, arg.length() - 10);
-                if (value.empty() || !isValidBookName(value)) {
-                    cout << "Invalid\n";
+            } else if (startsWith(arg, "-name=")) {
+                query = QUERY_NAME;
+                if (!quotedValue(arg, 6, value) || !isValidBookName(value)) {
+                    invalid();
                     return;
                 }
-            } else if (arg.substr(0, 9) == "-keyword=") {
-                if (arg.length() < 12 || arg[9] != '"' || arg.back() != '"') {
-                    cout << "Invalid\n";
+            } else if (startsWith(arg, "-author=")) {
+                query = QUERY_AUTHOR;
+                if (!quotedValue(arg, 8, value) || !isValidBookName(value)) {
+                    invalid();
                     return;
                 }
-                type = "keyword";
-                value = arg.substr(10, arg.length() - 11);
-                if (value.empty() || !isValidBookName(value)) {
-                    cout << "Invalid\n";
+            } else if (startsWith(arg, "-keyword=")) {
+                query = QUERY_KEYWORD;
+                if (!quotedValue(arg, 9, value) || !isValidBookName(value)) {
+                    invalid();
                     return;
                 }
                 // Check if keyword contains '|'
-                if (value.find('|') != string::npos) {
-                    cout << "Invalid\n";
+                if (value.find('|') != string_view::npos) {
+                    invalid();
                     return;
                 }
             } else {
-                cout << "Invalid\n";
+                invalid();
                 return;
             }
-        } else {
-            cout << "Invalid\n";
+        } else if (!args.empty()) {
+            invalid();
             return;
         }
 
-        vector<Book> books = bookMgr.searchBooks(type, value);
+        bool found = false;
+        bookMgr.searchBooks(query, value, [&](const Book& book) {
+            found = true;
+            out.writeField(book.ISBN);
+            out.write('\t');
+            out.writeField(book.name);
+            out.write('\t');
+            out.writeField(book.author);
+            out.write('\t');
+            out.writeField(book.keyword);
+            out.write('\t');
+            out.writeMoney(book.price);
+            out.write('\t');
+            out.writeInt(book.quantity);
+            out.write('\n');
+            return true;
+        });
 
-        if (books.empty()) {
-            cout << "\n";
-        } else {
-            for (const Book& book : books) {
-                cout << book.ISBN << "\t" << book.name << "\t" << book.author << "\t"
-                     << book.keyword << "\t" << fixed << setprecision(2) << book.price << "\t"
-                     << book.quantity << "\n";
-            }
-        }
+        if (!found) out.write('\n');
     }
 
-    void cmdBuy(const vector<string>& args) {
+    void cmdBuy(ArgList args) {
         if (getCurrentPrivilege() < 1) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
         if (args.size() != 2) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string ISBN = args[0];
-        string quantityStr = args[1];
+        string_view ISBN = args[0];
+        string_view quantityStr = args[1];
+        setTarget(ISBN);
 
         if (!isValidISBN(ISBN) || !isValidQuantity(quantityStr)) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        long long quantity = stoll(quantityStr);
+        long long quantity = parseQuantity(quantityStr);
         if (quantity <= 0 || quantity > 2147483647) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        Book* book = bookMgr.getBook(ISBN);
-        if (!book) {
-            cout << "Invalid\n";
+        Money price;
+        int stock;
+        if (!bookMgr.getStock(ISBN, price, stock)) {
+            invalid();
             return;
         }
 
-        if (book->quantity < (int)quantity) {
-            cout << "Invalid\n";
+        if (stock < (int)quantity) {
+            invalid();
             return;
         }
 
-        double total = book->price * quantity;
+        Money total = price * quantity;
         bookMgr.buyBook(ISBN, (int)quantity);
-        financeMgr.addTransaction(total, true);
+        financeMgr.addTransaction(getCurrentUser(), ISBN, (int)quantity, total, true);
+        event.quantity = (int)quantity;
+        event.amount = total;
 
-        cout << fixed << setprecision(2) << total << "\n";
+        out.writeMoney(total);
+        out.write('\n');
     }
 
-    void cmdSelect(const vector<string>& args) {
+    void cmdSelect(ArgList args) {
         if (getCurrentPrivilege() < 3) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
         if (args.size() != 1) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string ISBN = args[0];
+        string_view ISBN = args[0];
+        setTarget(ISBN);
 
         if (!isValidISBN(ISBN)) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
@@ -808,169 +3563,151 @@ private:
             bookMgr.addBook(ISBN);
         }
 
-        selectedBooks[getCurrentUser()] = ISBN;
+        SessionFrame& frame = loginStack.back();
+        frame.hasSelection = true;
+        frame.selected = ISBN;
     }
 
-    void cmdModify(const vector<string>& args) {
+    void cmdModify(ArgList args) {
         if (getCurrentPrivilege() < 3) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string currentUser = getCurrentUser();
-        if (selectedBooks.find(currentUser) == selectedBooks.end()) {
-            cout << "Invalid\n";
+        SessionFrame* frame = selectedFrame();
+        if (!frame) {
+            invalid();
             return;
         }
 
-        string currentISBN = selectedBooks[currentUser];
+        string_view currentISBN = frame->selected.data;
+        setTarget(currentISBN);
 
         if (args.empty()) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string newISBN, name, author, keyword;
-        double price = -1;
-        set<string> usedParams;
+        string_view newISBN, name, author, keyword;
+        Money price = -1;
+        enum { ISBN_PARAM = 1, NAME_PARAM = 2, AUTHOR_PARAM = 4, KEYWORD_PARAM = 8, PRICE_PARAM = 16 };
+        int usedParams = 0;
 
-        for (const string& arg : args) {
-            string param;
-            if (arg.substr(0, 6) == "-ISBN=") {
-                param = "ISBN";
-                if (usedParams.count(param)) {
-                    cout << "Invalid\n";
-                    return;
-                }
-                usedParams.insert(param);
+        for (string_view arg : args) {
+            int param;
+            if (startsWith(arg, "-ISBN=")) {
+                param = ISBN_PARAM;
                 newISBN = arg.substr(6);
                 if (newISBN.empty() || !isValidISBN(newISBN)) {
-                    cout << "Invalid\n";
+                    invalid();
                     return;
                 }
                 if (newISBN == currentISBN) {
-                    cout << "Invalid\n";
+                    invalid();
                     return;
                 }
                 if (bookMgr.exists(newISBN)) {
-                    cout << "Invalid\n";
-                    return;
-                }
-            } else if (arg.substr(0, 6) == "-name=") {
-                param = "name";
-                if (usedParams.count(param)) {
-                    cout << "Invalid\n";
-                    return;
-                }
-                usedParams.insert(param);
-                if (arg.length() < 9 || arg[6] != '"' || arg.back() != '"') {
-                    cout << "Invalid\n";
-                    return;
-                }
-                name = arg.substr(7, arg.length() - 8);
-                if (name.empty() || !isValidBookName(name)) {
-                    cout << "Invalid\n";
-                    return;
-                }
-            } else if (arg.substr(0, 8) == "-author=") {
-                param = "author";
-                if (usedParams.count(param)) {
-                    cout << "Invalid\n";
-                    return;
-                }
-                usedParams.insert(param);
-                if (arg.length() < 11 || arg[8] != '"' || arg.back() != '"') {
-                    cout << "Invalid\n";
-                    return;
-                }
-                author = arg.substr(9, arg.length() - 10);
-                if (author.empty() || !isValidBookName(author)) {
-                    cout << "Invalid\n";
+                    invalid();
                     return;
                 }
-            } else if (arg.substr(0, 9) == "-keyword=") {
-                param = "keyword";
-                if (usedParams.count(param)) {
-                    cout << "Invalid\n";
+            } else if (startsWith(arg, "-name=")) {
+                param = NAME_PARAM;
+                if (!quotedValue(arg, 6, name) || !isValidBookName(name)) {
+                    invalid();
                     return;
                 }
-                usedParams.insert(param);
-                if (arg.length() < 12 || arg[9] != '"' || arg.back() != '"') {
-                    cout << "Invalid\n";
+            } else if (startsWith(arg, "-author=")) {
+                param = AUTHOR_PARAM;
+                if (!quotedValue(arg, 8, author) || !isValidBookName(author)) {
+                    invalid();
                     return;
                 }
-                keyword = arg.substr(10, arg.length() - 11);
-                if (keyword.empty() || !isValidKeyword(keyword)) {
-                    cout << "Invalid\n";
+            } else if (startsWith(arg, "-keyword=")) {
+                param = KEYWORD_PARAM;
+                if (!quotedValue(arg, 9, keyword) || !isValidKeyword(keyword)) {
+                    invalid();
                     return;
                 }
-            } else if (arg.substr(0, 7) == "-price=") {
-                param = "price";
-                if (usedParams.count(param)) {
-                    cout << "Invalid\n";
+            } else if (startsWith(arg, "-price=")) {
+                param = PRICE_PARAM;
+                if (!parsePrice(arg.substr(7), price)) {
+                    invalid();
                     return;
                 }
-                usedParams.insert(param);
-                string priceStr = arg.substr(7);
-                if (priceStr.empty() || !isValidPrice(priceStr)) {
-                    cout << "Invalid\n";
-                    return;
-                }
-                price = stod(priceStr);
             } else {
-                cout << "Invalid\n";
+                invalid();
+                return;
+            }
+
+            if (usedParams & param) {
+                invalid();
                 return;
             }
+            usedParams |= param;
         }
 
-        bookMgr.modifyBook(currentISBN, newISBN, name, author, keyword, price);
+        if (!bookMgr.modifyBook(currentISBN, newISBN, name, author, keyword, price)) {
+            invalid();
+            return;
+        }
+        if (!newISBN.empty()) financeMgr.renameBook(currentISBN, newISBN);
+        if (price >= 0) event.amount = price;
 
+        // Every login holding the book, in any session, follows it to its new
+        // ISBN. Modify holds the engine exclusively, so no other session runs.
         if (!newISBN.empty()) {
-            selectedBooks[currentUser] = newISBN;
+            ISBNKey oldKey = frame->selected;
+            for (BookstoreSystem* session : engine.sessions) session->followRename(oldKey, newISBN);
         }
     }
 
-    void cmdImport(const vector<string>& args) {
+    void cmdImport(ArgList args) {
         if (getCurrentPrivilege() < 3) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string currentUser = getCurrentUser();
-        if (selectedBooks.find(currentUser) == selectedBooks.end()) {
-            cout << "Invalid\n";
+        SessionFrame* frame = selectedFrame();
+        if (!frame) {
+            invalid();
             return;
         }
+        setTarget(frame->selected.data);
 
         if (args.size() != 2) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string quantityStr = args[0];
-        string totalCostStr = args[1];
+        string_view quantityStr = args[0];
+        string_view totalCostStr = args[1];
 
-        if (!isValidQuantity(quantityStr) || !isValidPrice(totalCostStr)) {
-            cout << "Invalid\n";
+        Money totalCost;
+        if (!isValidQuantity(quantityStr) || !parsePrice(totalCostStr, totalCost)) {
+            invalid();
             return;
         }
 
-        long long quantity = stoll(quantityStr);
-        double totalCost = stod(totalCostStr);
+        long long quantity = parseQuantity(quantityStr);
 
         if (quantity <= 0 || quantity > 2147483647 || totalCost <= 0) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
-        string ISBN = selectedBooks[currentUser];
-        bookMgr.importBook(ISBN, (int)quantity);
-        financeMgr.addTransaction(totalCost, false);
+        string_view ISBN = frame->selected.data;
+        if (!bookMgr.importBook(ISBN, (int)quantity)) {
+            invalid();
+            return;
+        }
+        financeMgr.addTransaction(getCurrentUser(), ISBN, (int)quantity, totalCost, false);
+        event.quantity = (int)quantity;
+        event.amount = totalCost;
     }
 
-    void cmdShowFinance(const vector<string>& args) {
+    void cmdShowFinance(ArgList args) {
         if (getCurrentPrivilege() < 7) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
 
@@ -978,130 +3715,499 @@ private:
 
         if (!args.empty()) {
             if (args.size() != 1) {
-                cout << "Invalid\n";
+                invalid();
                 return;
             }
 
-            string countStr = args[0];
+            string_view countStr = args[0];
             if (!isValidQuantity(countStr)) {
-                cout << "Invalid\n";
+                invalid();
                 return;
             }
 
-            count = stoi(countStr);
+            long long requested = parseQuantity(countStr);
 
-            if (count == 0) {
-                cout << "\n";
+            if (requested == 0) {
+                out.write('\n');
                 return;
             }
 
-            if (count > financeMgr.getTransactionCount()) {
-                cout << "Invalid\n";
+            if (requested > financeMgr.getTransactionCount()) {
+                invalid();
                 return;
             }
+            count = requested;
         }
 
         auto [income, expenditure] = financeMgr.getFinance(count);
-        cout << "+ " << fixed << setprecision(2) << income << " - " << expenditure << "\n";
+        out.write("+ ");
+        out.writeMoney(income);
+        out.write(" - ");
+        out.writeMoney(expenditure);
+        out.write('\n');
     }
 
+    // One line per logged command: sequence number, operator, command,
+    // target, quantity, amount and outcome, with "-" for fields that do
+    // not apply
     void cmdLog() {
         if (getCurrentPrivilege() < 7) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
-        // Self-defined format - just output empty line for now
-        cout << "\n";
+        operationLog.forEach([&](long long sequence, const LogEvent& logged) {
+            out.writeInt(sequence);
+            out.write(' ');
+            if (logged.operatorID[0]) {
+                out.writeField(logged.operatorID);
+            } else {
+                out.write('-');
+            }
+            out.write(' ');
+            out.write(commandName((CommandCode)logged.command));
+            out.write(' ');
+            if (logged.target[0]) {
+                out.writeField(logged.target);
+            } else {
+                out.write('-');
+            }
+            out.write(' ');
+            if (logged.quantity) {
+                out.writeInt(logged.quantity);
+            } else {
+                out.write('-');
+            }
+            out.write(' ');
+            if (logged.amount) {
+                out.writeMoney(logged.amount);
+            } else {
+                out.write('-');
+            }
+            out.write(logged.success ? " ok\n" : " invalid\n");
+        });
+    }
+
+    void writeBucket(int first, int last, const FinanceManager::Rollup& rollup) {
+        out.writeInt(first);
+        out.write('-');
+        out.writeInt(last);
+        out.write(" + ");
+        out.writeMoney(rollup.income);
+        out.write(" - ");
+        out.writeMoney(rollup.expenditure);
+        out.write('\n');
     }
 
+    // Totals, income and expenditure per 64k and per 1k transactions, the
+    // best-selling books by revenue, then every book's sales and imports,
+    // all read from the finance rollups
     void cmdReportFinance() {
         if (getCurrentPrivilege() < 7) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
-        // Self-defined format - just output empty line for now
-        cout << "\n";
+        static const size_t TOP_SELLERS = 10;
+        typedef FinanceManager::Rollup Rollup;
+
+        auto [income, expenditure] = financeMgr.getFinance(-1);
+        out.write("total ");
+        out.writeInt(financeMgr.getTransactionCount());
+        out.write(" + ");
+        out.writeMoney(income);
+        out.write(" - ");
+        out.writeMoney(expenditure);
+        out.write('\n');
+
+        for (int bucketSize : {FinanceManager::COARSE_BUCKET, FinanceManager::FINE_BUCKET}) {
+            out.write("per ");
+            out.writeInt(bucketSize);
+            out.write(" transactions\n");
+            financeMgr.forEachBucket(bucketSize, [&](int first, int last, const Rollup& rollup) {
+                writeBucket(first, last, rollup);
+            });
+        }
+
+        // The best sellers so far in a bounded heap whose front is the
+        // weakest of them; the book list is streamed in a second pass
+        typedef pair<ISBNKey, Rollup> Seller;
+        auto better = [](const Seller& a, const Seller& b) {
+            if (a.second.income != b.second.income) return a.second.income > b.second.income;
+            return a.first < b.first;
+        };
+        vector<Seller> sellers;
+        sellers.reserve(TOP_SELLERS + 1);
+        financeMgr.forEachBook([&](const ISBNKey& ISBN, const Rollup& rollup) {
+            if (rollup.unitsSold == 0) return;
+            Seller seller(ISBN, rollup);
+            if (sellers.size() == TOP_SELLERS) {
+                if (!better(seller, sellers.front())) return;
+                pop_heap(sellers.begin(), sellers.end(), better);
+                sellers.pop_back();
+            }
+            sellers.push_back(seller);
+            push_heap(sellers.begin(), sellers.end(), better);
+        });
+        sort_heap(sellers.begin(), sellers.end(), better);
+        out.write("top sellers\n");
+        for (const auto& [ISBN, rollup] : sellers) {
+            out.writeField(ISBN.data);
+            out.write(" sold ");
+            out.writeInt(rollup.unitsSold);
+            out.write(" + ");
+            out.writeMoney(rollup.income);
+            out.write('\n');
+        }
+
+        out.write("books\n");
+        financeMgr.forEachBook([&](const ISBNKey& ISBN, const Rollup& rollup) {
+            out.writeField(ISBN.data);
+            out.write(" sold ");
+            out.writeInt(rollup.unitsSold);
+            out.write(" + ");
+            out.writeMoney(rollup.income);
+            out.write(" imported ");
+            out.writeInt(rollup.unitsImported);
+            out.write(" - ");
+            out.writeMoney(rollup.expenditure);
+            out.write('\n');
+        });
     }
 
+    // One line per employee with their command counts, units imported,
+    // money spent on imports and the log event of their last activity
     void cmdReportEmployee() {
         if (getCurrentPrivilege() < 7) {
-            cout << "Invalid\n";
+            invalid();
             return;
         }
-        // Self-defined format - just output empty line for now
-        cout << "\n";
+        bool found = false;
+        employeeMgr.forEach([&](const UserIDKey& userID, const EmployeeStats& stats) {
+            found = true;
+            out.writeField(userID.data);
+            out.write(" select ");
+            out.writeInt(stats.selects);
+            out.write(" modify ");
+            out.writeInt(stats.modifies);
+            out.write(" import ");
+            out.writeInt(stats.imports);
+            out.write(" useradd ");
+            out.writeInt(stats.useradds);
+            out.write(" units ");
+            out.writeInt(stats.unitsImported);
+            out.write(" spent ");
+            out.writeMoney(stats.spent);
+            out.write(" last ");
+            out.writeInt(stats.lastActivity);
+            out.write('\n');
+        });
+        if (!found) out.write('\n');
     }
 
 public:
-    void processCommand(const string& line) {
-        string trimmed = trim(line);
-        if (trimmed.empty()) return;
-
-        vector<string> parts = split(trimmed);
-        if (parts.empty()) return;
-
-        string cmd = parts[0];
-        vector<string> args(parts.begin() + 1, parts.end());
-
-        if (cmd == "quit" || cmd == "exit") {
-            exit(0);
-        } else if (cmd == "su") {
-            cmdSu(args);
-        } else if (cmd == "logout") {
-            cmdLogout();
-        } else if (cmd == "register") {
-            cmdRegister(args);
-        } else if (cmd == "passwd") {
-            cmdPasswd(args);
-        } else if (cmd == "useradd") {
-            cmdUseradd(args);
-        } else if (cmd == "delete") {
-            cmdDelete(args);
-        } else if (cmd == "show") {
-            if (!args.empty() && args[0] == "finance") {
-                vector<string> financeArgs(args.begin() + 1, args.end());
-                cmdShowFinance(financeArgs);
-            } else {
-                cmdShow(args);
+    BookstoreSystem(BookstoreEngine& shared, int input, int output)
+        : engine(shared),
+          inputFd(input),
+          out(output),
+          accountMgr(shared.accountMgr),
+          bookMgr(shared.bookMgr),
+          financeMgr(shared.financeMgr),
+          employeeMgr(shared.employeeMgr),
+          operationLog(shared.operationLog),
+          loginCounts(shared.loginCounts),
+          running(true) {
+        unique_lock<shared_mutex> lock(engine.commandLock);
+        engine.sessions.insert(this);
+    }
+
+    ~BookstoreSystem() {
+        unique_lock<shared_mutex> lock(engine.commandLock);
+        engine.sessions.erase(this);
+    }
+
+    // How a command line locks the engine when sessions run concurrently
+    enum LockMode { LOCK_SEARCH, LOCK_UPDATE, LOCK_EXCLUSIVE };
+
+    static LockMode lockModeOf(string_view line) {
+        size_t begin = line.find_first_not_of(' ');
+        if (begin == string_view::npos) return LOCK_SEARCH;
+        size_t end = line.find(' ', begin);
+        switch (lookupCommand(line.substr(begin, end - begin))) {
+            case CMD_SHOW: {
+                if (end == string_view::npos) return LOCK_SEARCH;
+                size_t second = line.find_first_not_of(' ', end);
+                if (second == string_view::npos) return LOCK_SEARCH;
+                string_view rest = line.substr(second);
+                return rest.substr(0, rest.find(' ')) == "finance" ? LOCK_UPDATE : LOCK_SEARCH;
+            }
+            case CMD_BUY:
+            case CMD_IMPORT:
+                return LOCK_UPDATE;
+            default:
+                return LOCK_EXCLUSIVE;
+        }
+    }
+
+    void processCommand(string_view line) {
+        // No command takes this many tokens, so a longer line is rejected
+        string_view tokens[MAX_TOKENS];
+        size_t count = 0;
+        size_t pos = 0;
+        while (true) {
+            while (pos < line.length() && line[pos] == ' ') pos++;
+            if (pos == line.length()) break;
+            size_t end = line.find(' ', pos);
+            if (end == string_view::npos) end = line.length();
+            if (count == MAX_TOKENS) {
+                out.write("Invalid\n");
+                return;
             }
-        } else if (cmd == "buy") {
-            cmdBuy(args);
-        } else if (cmd == "select") {
-            cmdSelect(args);
-        } else if (cmd == "modify") {
-            cmdModify(args);
-        } else if (cmd == "import") {
-            cmdImport(args);
-        } else if (cmd == "log") {
-            cmdLog();
-        } else if (cmd == "report") {
-            if (args.size() == 1) {
-                if (args[0] == "finance") {
+            tokens[count++] = line.substr(pos, end - pos);
+            pos = end;
+        }
+        if (count == 0) return;
+
+        ArgList args(tokens + 1, tokens + count);
+        CommandCode code = lookupCommand(tokens[0]);
+
+        memset(&event, 0, sizeof(event));
+        copyField(event.operatorID, getCurrentUser());
+        event.command = code;
+        event.success = true;
+
+        switch (code) {
+            case CMD_QUIT:
+                running = false;
+                break;
+            case CMD_SU:
+                cmdSu(args);
+                break;
+            case CMD_LOGOUT:
+                cmdLogout();
+                break;
+            case CMD_REGISTER:
+                cmdRegister(args);
+                break;
+            case CMD_PASSWD:
+                cmdPasswd(args);
+                break;
+            case CMD_USERADD:
+                cmdUseradd(args);
+                break;
+            case CMD_DELETE:
+                cmdDelete(args);
+                break;
+            case CMD_SHOW:
+                if (!args.empty() && args[0] == "finance") {
+                    cmdShowFinance(args.tail());
+                } else {
+                    cmdShow(args);
+                }
+                break;
+            case CMD_BUY:
+                cmdBuy(args);
+                break;
+            case CMD_SELECT:
+                cmdSelect(args);
+                break;
+            case CMD_MODIFY:
+                cmdModify(args);
+                break;
+            case CMD_IMPORT:
+                cmdImport(args);
+                break;
+            case CMD_LOG:
+                cmdLog();
+                break;
+            case CMD_REPORT:
+                if (args.size() == 1 && args[0] == "finance") {
                     cmdReportFinance();
-                } else if (args[0] == "employee") {
+                } else if (args.size() == 1 && args[0] == "employee") {
                     cmdReportEmployee();
                 } else {
-                    cout << "Invalid\n";
+                    invalid();
                 }
+                break;
+            default:
+                invalid();
+                break;
+        }
+
+        long long number;
+        {
+            lock_guard<mutex> lock(engine.logMutex);
+            number = operationLog.append(event);
+        }
+        if (event.success) recordEmployeeActivity(number);
+    }
+
+    // Credits a successful employee command to its operator. This runs once
+    // the event is appended, so the number is this command's own even when
+    // other sessions log at the same time.
+    void recordEmployeeActivity(long long number) {
+        string_view userID = event.operatorID;
+        switch (event.command) {
+            case CMD_USERADD:
+                employeeMgr.recordUseradd(userID, number);
+                break;
+            case CMD_SELECT:
+                employeeMgr.recordSelect(userID, number);
+                break;
+            case CMD_MODIFY:
+                employeeMgr.recordModify(userID, number);
+                break;
+            case CMD_IMPORT:
+                employeeMgr.recordImport(userID, event.quantity, event.amount, number);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Runs the only session of the process on its input
+    void run() {
+        LineReader input(inputFd);
+        string_view line;
+        // A person at a terminal needs each reply before typing the next
+        // command; batch input only flushes when the buffer fills
+        bool interactive = isatty(inputFd);
+        while (running && input.nextLine(line)) {
+            {
+                // Keeps the idle flush out of the command
+                unique_lock<shared_mutex> lock(engine.commandLock);
+                processCommand(line);
+                engine.maybeFlush();
+            }
+            if (interactive) out.flush();
+        }
+        out.flush();
+    }
+
+    // Runs one of several concurrent sessions, replying to every command
+    // before reading the next
+    void serve() {
+        LineReader input(inputFd);
+        string_view line;
+        // Each reply is written only once the engine lock is released
+        out.setSpooling(true);
+        while (running && input.nextLine(line)) {
+            LockMode mode = lockModeOf(line);
+            if (mode == LOCK_SEARCH) {
+                shared_lock<shared_mutex> lock(engine.commandLock);
+                processCommand(line);
+            } else if (mode == LOCK_UPDATE) {
+                shared_lock<shared_mutex> lock(engine.commandLock);
+                lock_guard<mutex> update(engine.updateMutex);
+                processCommand(line);
+                engine.maybeFlush();
             } else {
-                cout << "Invalid\n";
+                unique_lock<shared_mutex> lock(engine.commandLock);
+                processCommand(line);
+                engine.maybeFlush();
             }
-        } else {
-            cout << "Invalid\n";
+            out.flush();
+        }
+        out.flush();
+
+        // Logins end with the session, and so does its work's durability
+        unique_lock<shared_mutex> lock(engine.commandLock);
+        while (!loginStack.empty()) {
+            auto count = loginCounts.find(loginStack.back().record.slot);
+            if (--count->second == 0) loginCounts.erase(count);
+            loginStack.pop_back();
+        }
+        engine.flush();
+    }
+};
+
+// Accepts clients on a Unix domain socket and runs a session for each on
+// its own thread, all sharing one engine. A termination signal stops new
+// connections, ends the open ones and waits for their sessions to finish.
+class SessionServer {
+private:
+    static volatile sig_atomic_t stopRequested;
+
+    static void requestStop(int) {
+        stopRequested = 1;
+    }
+
+    BookstoreEngine& engine;
+    string path;
+    int listenFd;
+    mutex sessionsMutex;
+    condition_variable sessionEnded;
+    set<int> clients;
+
+    void runSession(int client) {
+        {
+            BookstoreSystem session(engine, client, client);
+            session.serve();
         }
+        lock_guard<mutex> lock(sessionsMutex);
+        clients.erase(client);
+        close(client);
+        sessionEnded.notify_all();
     }
 
+public:
+    SessionServer(BookstoreEngine& shared, const string& socketPath)
+        : engine(shared), path(socketPath), listenFd(-1) {}
+
     void run() {
-        string line;
-        while (getline(cin, line)) {
-            processCommand(line);
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.length() >= sizeof(address.sun_path)) throw runtime_error("socket path too long");
+        memcpy(address.sun_path, path.c_str(), path.length());
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0) throw runtime_error("cannot create socket");
+        unlink(path.c_str());
+        if (bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 64) != 0) {
+            throw runtime_error("cannot listen on " + path);
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, requestStop);
+        signal(SIGTERM, requestStop);
+        engine.enableConcurrency();
+
+        while (!stopRequested) {
+            pollfd waiting = {listenFd, POLLIN, 0};
+            if (poll(&waiting, 1, 200) <= 0) continue;
+            int client = accept(listenFd, nullptr, nullptr);
+            if (client < 0) continue;
+            lock_guard<mutex> lock(sessionsMutex);
+            clients.insert(client);
+            thread(&SessionServer::runSession, this, client).detach();
         }
+
+        close(listenFd);
+        unlink(path.c_str());
+        unique_lock<mutex> lock(sessionsMutex);
+        for (int client : clients) shutdown(client, SHUT_RDWR);
+        sessionEnded.wait(lock, [&] { return clients.empty(); });
     }
 };
 
-int main() {
-    BookstoreSystem system;
-    system.run();
+volatile sig_atomic_t SessionServer::stopRequested = 0;
+
+// Reads commands from standard input, or with --serve <socket> serves
+// many clients at once over a Unix domain socket
+int main(int argc, char* argv[]) {
+    int poolPages = BUFFER_POOL_PAGES;
+    if (const char* env = getenv("BOOKSTORE_POOL_PAGES")) {
+        poolPages = atoi(env);
+    }
+
+    BookstoreEngine engine(poolPages);
+    if (argc == 3 && string_view(argv[1]) == "--serve") {
+        SessionServer server(engine, argv[2]);
+        server.run();
+    } else {
+        BookstoreSystem system(engine, STDIN_FILENO, STDOUT_FILENO);
+        system.run();
+    }
+    engine.shutdown();
     return 0;
 }
 